@@ -0,0 +1,458 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/* Throughput and latency benchmark for libringbuffer, for a Linux host.
+ *
+ * A producer and a consumer thread, each pinned to a chosen core, pass
+ * messages through a ring in an mmap'd shared region. For every mode and
+ * message size, one line of CSV is written to stdout with the throughput and
+ * the 50th, 99th and 99.9th percentile one-way latency of a message, measured
+ * from just before it is sent until it has been fully received.
+ *
+ * The byte-stream and framed rings have no flow control, so the producer is
+ * held back to a window of messages in flight using a counter that is
+ * private to the benchmark. A window of 1 measures unloaded latency.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ringbuffer/ringbuffer.h>
+#include <ringbuffer/spsc.h>
+
+#define DEFAULT_REGION_SIZE     (1 << 20)
+#define DEFAULT_TOTAL_BYTES     (256 << 20)
+#define MIN_MESSAGES            10000
+#define MAX_MESSAGES            1000000
+
+typedef enum {
+    MODE_BYTE,          /* rb_transmit_byte/rb_receive_byte */
+    MODE_BULK,          /* rb_transmit/rb_receive */
+    MODE_FRAMED,        /* rb_transmit/rb_receive with RB_FLAG_FRAMED */
+    MODE_SPSC,          /* rb_spsc_write/rb_spsc_read */
+    NUM_MODES
+} bench_mode_t;
+
+static const char *mode_names[NUM_MODES] = { "byte", "bulk", "framed", "spsc" };
+
+static const size_t default_sizes[] = { 1, 16, 64, 256, 1024, 4096, 16384, 65536 };
+
+typedef struct bench {
+    bench_mode_t mode;
+    size_t msg_size;
+    size_t count;           /* Number of messages to send */
+    size_t window;          /* Maximum messages in flight */
+    int prod_cpu;
+    int cons_cpu;
+    int yield;              /* Yield rather than spin when waiting */
+
+    unsigned char *region;  /* Shared region holding the ring */
+    size_t region_size;
+    uint64_t *sent;         /* Time each message was sent */
+    uint64_t *received;     /* Time each message was received */
+    uint64_t consumed;      /* Messages fully received so far */
+    pthread_barrier_t start;    /* Both ends attached */
+} bench_t;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void relax(bench_t *b)
+{
+    if (b->yield) {
+        sched_yield();
+    } else {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+        asm volatile("yield");
+#endif
+    }
+}
+
+static void yield_wait(void *cookie)
+{
+    (void)cookie;
+    sched_yield();
+}
+
+static void no_notify(void *cookie)
+{
+    (void)cookie;
+}
+
+/* Largest message a framed ring in a region of the given size can carry: the
+ * data area after the control block, rounded down to the record alignment,
+ * less the 8-byte record header.
+ */
+static size_t framed_max_msg(size_t region_size)
+{
+    if (region_size < RB_CTRL_SIZE + 16) {
+        return 0;
+    }
+    return ((region_size - RB_CTRL_SIZE) & ~(size_t)7) - 8;
+}
+
+static void pin(int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0) {
+        return;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        fprintf(stderr, "warning: failed to pin to cpu %d: %s\n", cpu, strerror(err));
+    }
+}
+
+/* Both ends of a ring, each set up by its own thread as two components would. */
+typedef struct endpoint {
+    ringbuffer_t rb;
+    rb_spsc_t spsc;
+} endpoint_t;
+
+#define SPSC_CTRL(b)    ((rb_spsc_ctrl_t *)(b)->region)
+#define SPSC_DATA(b)    ((b)->region + sizeof(rb_spsc_ctrl_t))
+#define SPSC_SIZE(b)    ((b)->region_size / 2)
+
+static int attach(bench_t *b, endpoint_t *e, int producer)
+{
+    if (b->mode == MODE_SPSC) {
+        if (producer) {
+            return rb_spsc_init_producer(&e->spsc, SPSC_CTRL(b), SPSC_DATA(b), SPSC_SIZE(b));
+        }
+        return rb_spsc_init_consumer(&e->spsc, SPSC_CTRL(b), SPSC_DATA(b), SPSC_SIZE(b));
+    }
+
+    if (rb_attach(&e->rb, b->region) != 0) {
+        return -1;
+    }
+    if (b->yield) {
+        rb_wait_ops_t ops = { .wait = yield_wait, .notify = no_notify };
+        rb_set_wait_ops(&e->rb, &ops);
+    }
+    return 0;
+}
+
+static void *producer(void *arg)
+{
+    bench_t *b = arg;
+    endpoint_t e;
+    unsigned char *msg = malloc(b->msg_size);
+
+    pin(b->prod_cpu);
+    if (msg == NULL || attach(b, &e, 1) != 0) {
+        fprintf(stderr, "producer: setup failed\n");
+        exit(1);
+    }
+    pthread_barrier_wait(&b->start);
+    /* The byte-stream modes can't carry 0s. */
+    memset(msg, 'x', b->msg_size);
+
+    for (size_t i = 0; i < b->count; i++) {
+        if (b->mode != MODE_SPSC) {
+            while (i - __atomic_load_n(&b->consumed, __ATOMIC_ACQUIRE) >= b->window) {
+                relax(b);
+            }
+        }
+
+        b->sent[i] = now_ns();
+        switch (b->mode) {
+        case MODE_BYTE:
+            for (size_t j = 0; j < b->msg_size; j++) {
+                rb_transmit_byte(&e.rb, msg[j]);
+            }
+            break;
+        case MODE_BULK:
+        case MODE_FRAMED:
+            /* A short send would leave the consumer waiting forever. */
+            if (rb_transmit(&e.rb, msg, b->msg_size) != b->msg_size) {
+                fprintf(stderr, "producer: failed to send %zu byte message\n", b->msg_size);
+                exit(1);
+            }
+            break;
+        case MODE_SPSC:
+            for (size_t sent = 0; sent < b->msg_size;) {
+                size_t n = rb_spsc_write(&e.spsc, msg + sent, b->msg_size - sent);
+                if (n == 0) {
+                    relax(b);
+                }
+                sent += n;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    free(msg);
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    bench_t *b = arg;
+    endpoint_t e;
+    unsigned char *msg = malloc(b->msg_size);
+
+    pin(b->cons_cpu);
+    if (msg == NULL || attach(b, &e, 0) != 0) {
+        fprintf(stderr, "consumer: setup failed\n");
+        exit(1);
+    }
+    pthread_barrier_wait(&b->start);
+
+    for (size_t i = 0; i < b->count; i++) {
+        switch (b->mode) {
+        case MODE_BYTE:
+            for (size_t j = 0; j < b->msg_size; j++) {
+                msg[j] = rb_receive_byte(&e.rb);
+            }
+            break;
+        case MODE_BULK:
+        case MODE_FRAMED:
+            rb_receive(&e.rb, msg, b->msg_size);
+            break;
+        case MODE_SPSC:
+            for (size_t got = 0; got < b->msg_size;) {
+                size_t n = rb_spsc_read(&e.spsc, msg + got, b->msg_size - got);
+                if (n == 0) {
+                    relax(b);
+                }
+                got += n;
+            }
+            break;
+        default:
+            break;
+        }
+        b->received[i] = now_ns();
+        __atomic_store_n(&b->consumed, i + 1, __ATOMIC_RELEASE);
+    }
+    free(msg);
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, double p)
+{
+    size_t i = (size_t)(p * (double)(n - 1) + 0.5);
+    return sorted[i];
+}
+
+static int run(bench_t *b)
+{
+    pthread_t prod, cons;
+
+    b->sent = calloc(b->count, sizeof(uint64_t));
+    b->received = calloc(b->count, sizeof(uint64_t));
+    if (b->sent == NULL || b->received == NULL) {
+        return -1;
+    }
+    b->consumed = 0;
+
+    if (b->mode == MODE_SPSC) {
+        rb_spsc_init_ctrl(SPSC_CTRL(b));
+    } else {
+        ringbuffer_t rb;
+        unsigned flags = b->mode == MODE_FRAMED ? RB_FLAG_FRAMED : 0;
+        if (rb_init_shared(&rb, b->region, b->region_size, flags) != 0) {
+            return -1;
+        }
+    }
+
+    /* Keep well clear of lapping the consumer. */
+    size_t capacity = b->mode == MODE_SPSC ? SPSC_SIZE(b) : b->region_size;
+    size_t window = capacity / 2 / (b->msg_size + 16);
+    if (window == 0) {
+        window = 1;
+    }
+    if (b->window == 0 || b->window > window) {
+        b->window = window;
+    }
+
+    /* Both ends start from wherever the sender is when they attach, so the
+     * producer must not start until the consumer has attached.
+     */
+    pthread_barrier_init(&b->start, NULL, 2);
+    pthread_create(&cons, NULL, consumer, b);
+    pthread_create(&prod, NULL, producer, b);
+    pthread_join(prod, NULL);
+    pthread_join(cons, NULL);
+    pthread_barrier_destroy(&b->start);
+
+    double secs = (double)(b->received[b->count - 1] - b->sent[0]) / 1e9;
+    for (size_t i = 0; i < b->count; i++) {
+        b->received[i] -= b->sent[i];
+    }
+    qsort(b->received, b->count, sizeof(uint64_t), compare_u64);
+
+    printf("%s,%zu,%zu,%zu,%.6f,%.0f,%.0f,%llu,%llu,%llu\n",
+           mode_names[b->mode], b->msg_size, b->count, b->window, secs,
+           (double)(b->count * b->msg_size) / secs, (double)b->count / secs,
+           (unsigned long long)percentile(b->received, b->count, 0.5),
+           (unsigned long long)percentile(b->received, b->count, 0.99),
+           (unsigned long long)percentile(b->received, b->count, 0.999));
+    fflush(stdout);
+
+    free(b->sent);
+    free(b->received);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-m mode] [-s size] [-n count] [-w window] [-r region] [-p cpu] [-c cpu] [-y]\n"
+            "  -m mode    byte, bulk, framed or spsc; may be repeated (default: all)\n"
+            "  -s size    message size in bytes; may be repeated (default: 1 B to 64 KiB)\n"
+            "  -n count   messages per run (default: %d MiB worth, within [%d, %d])\n"
+            "  -w window  maximum messages in flight; 1 measures unloaded latency\n"
+            "  -r region  size of the shared region in bytes, a power of 2 (default: %d)\n"
+            "  -p cpu     core to pin the producer to (default: 0, -1 for none)\n"
+            "  -c cpu     core to pin the consumer to (default: 1, -1 for none)\n"
+            "  -y         yield instead of spinning while waiting\n",
+            prog, DEFAULT_TOTAL_BYTES >> 20, MIN_MESSAGES, MAX_MESSAGES, DEFAULT_REGION_SIZE);
+}
+
+int main(int argc, char **argv)
+{
+    int modes = 0;
+    size_t sizes[32];
+    size_t nsizes = 0;
+    size_t count = 0;
+    size_t window = 0;
+    size_t region_size = DEFAULT_REGION_SIZE;
+    int prod_cpu = 0;
+    int cons_cpu = 1;
+    int yield = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:s:n:w:r:p:c:yh")) != -1) {
+        switch (opt) {
+        case 'm': {
+            int m;
+            for (m = 0; m < NUM_MODES && strcmp(optarg, mode_names[m]) != 0; m++);
+            if (m == NUM_MODES) {
+                usage(argv[0]);
+                return 1;
+            }
+            modes |= 1 << m;
+            break;
+        }
+        case 's':
+            if (nsizes == sizeof(sizes) / sizeof(sizes[0])) {
+                usage(argv[0]);
+                return 1;
+            }
+            sizes[nsizes++] = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            count = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            window = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            region_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            prod_cpu = atoi(optarg);
+            break;
+        case 'c':
+            cons_cpu = atoi(optarg);
+            break;
+        case 'y':
+            yield = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (modes == 0) {
+        modes = (1 << NUM_MODES) - 1;
+    }
+    if ((modes & (1 << MODE_SPSC)) &&
+        (region_size == 0 || (region_size & (region_size - 1)) != 0 || region_size > (1u << 31))) {
+        fprintf(stderr, "spsc needs a region size that is a power of 2 no larger than 2^31\n");
+        return 1;
+    }
+    if (nsizes == 0) {
+        nsizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+        memcpy(sizes, default_sizes, sizeof(default_sizes));
+    }
+
+    /* The SPSC ring takes a power of 2 sized data area after its control
+     * block, so give it twice the region and use half.
+     */
+    size_t map_size = region_size * 2 + sizeof(rb_spsc_ctrl_t);
+    unsigned char *region = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    printf("mode,msg_size,messages,window,seconds,bytes_per_sec,msgs_per_sec,p50_ns,p99_ns,p999_ns\n");
+    for (int m = 0; m < NUM_MODES; m++) {
+        if (!(modes & (1 << m))) {
+            continue;
+        }
+        for (size_t i = 0; i < nsizes; i++) {
+            bench_t b = {
+                .mode = m,
+                .msg_size = sizes[i],
+                .window = window,
+                .prod_cpu = prod_cpu,
+                .cons_cpu = cons_cpu,
+                .yield = yield,
+                .region = region,
+                .region_size = m == MODE_SPSC ? region_size * 2 : region_size,
+            };
+
+            if (b.msg_size == 0 || (m == MODE_FRAMED && b.msg_size > framed_max_msg(region_size))) {
+                fprintf(stderr, "skipping %s with %zu byte messages\n", mode_names[m], b.msg_size);
+                continue;
+            }
+
+            b.count = count;
+            if (b.count == 0) {
+                b.count = DEFAULT_TOTAL_BYTES / b.msg_size;
+                b.count = b.count < MIN_MESSAGES ? MIN_MESSAGES : b.count;
+                b.count = b.count > MAX_MESSAGES ? MAX_MESSAGES : b.count;
+            }
+
+            if (run(&b) != 0) {
+                fprintf(stderr, "%s with %zu byte messages failed\n", mode_names[m], b.msg_size);
+                return 1;
+            }
+        }
+    }
+
+    munmap(region, map_size);
+    return 0;
+}
@@ -13,38 +13,160 @@
  * characters at a rapid rate can have an entire buffer's worth of their data
  * missed by the receiver. This is semi-deliberate because any mechanism to
  * prevent this would introduce a back channel from the receiver to the sender.
+ *
+ * By default the buffer carries a stream of non-zero bytes, with a 0 marking
+ * where the receiver should wait for more data. A buffer created with
+ * RB_FLAG_FRAMED instead carries length-prefixed records that may contain any
+ * byte values. The records are published by the sender advancing a single
+ * commit position at the start of the region, so the receiver still never
+ * writes to the shared memory.
+ *
+ * For a flow-controlled ring between endpoints on different cores, see
+ * ringbuffer/spsc.h.
  */
 
 #pragma once
 
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
-/* Opaque type. Callers should be agnostic to the contents of this struct. */
+/* Opaque type. Callers should be agnostic to the contents of this struct. It is
+ * only defined below so that callers can provide the storage for one when
+ * using rb_init_shared or rb_attach.
+ */
 typedef struct ringbuffer ringbuffer_t;
 
+/* A contiguous part of the buffer. A record that wraps around the end of the
+ * buffer is described by two spans, the second of which starts at the
+ * beginning of the buffer. Unused spans have a length of 0.
+ */
+typedef struct rb_span {
+    void *base;
+    size_t len;
+} rb_span_t;
+
+/* Data a receiver has missed because the sender overwrote it first. */
+typedef struct rb_loss {
+    uint64_t bytes;     /* Bytes of records skipped or discarded */
+    uint64_t records;   /* Number of records skipped or discarded */
+} rb_loss_t;
+
+/* Hooks for blocking instead of busy waiting, for example on an seL4
+ * notification. wait must return if notify has been called since it last
+ * returned, even if notify was called before wait.
+ */
+typedef struct rb_wait_ops {
+    void (*wait)(void *cookie);     /* Block the receiver until notified */
+    void (*notify)(void *cookie);   /* Wake the receiver */
+    void *cookie;                   /* User-defined cookie */
+} rb_wait_ops_t;
+
+struct ringbuffer {
+    volatile unsigned char *base;   /* Start of the data area */
+    size_t size;                    /* Size of the data area */
+    off_t offset;                   /* Our slot in the data area */
+    unsigned flags;
+    struct rb_ctrl *ctrl;           /* Shared control block, if there is one */
+    uint64_t pos;                   /* Free-running position, framed mode only */
+    size_t reserved;                /* Size of the record reserved by rb_reserve */
+    size_t peeked;                  /* Size of the record held by rb_peek */
+    uint32_t seq;                   /* Sequence number of the next record */
+    uint64_t tail;                  /* Sender's copy of the oldest intact record */
+    off_t tail_offset;              /* Slot in the data area of tail */
+    rb_loss_t loss;                 /* What the receiver has missed so far */
+    rb_wait_ops_t wait_ops;         /* Hooks for blocking, if any */
+    unsigned spin;                  /* Polls before blocking */
+};
+
+/* Size of the control block at the start of a framed region, or of one set
+ * up by rb_init_shared. It spans two cache lines, one written only by the
+ * sender and one only by the receiver, provided the region is aligned to a
+ * cache line.
+ */
+#define RB_CTRL_SIZE            128
+
+/* Flags for rb_new_flags(). */
+
+/* Carry length-prefixed records instead of a zero-terminated byte stream. The
+ * region must be 8-byte aligned and initially zeroed, and its first
+ * RB_CTRL_SIZE bytes are used for the control block.
+ */
+#define RB_FLAG_FRAMED          (1u << 0)
+
+/* In framed mode, have the sender publish the position of the oldest record
+ * it has not started to overwrite. This costs the sender a walk over the
+ * headers of the records it overwrites, and lets the receiver detect every
+ * record that was overwritten while it was reading it and pick up again from
+ * the oldest intact record rather than the newest after being lapped.
+ * Requires RB_FLAG_FRAMED.
+ */
+#define RB_FLAG_SEQUENCED       (1u << 1)
+
+/* Use the buffer as a flight recorder: an always-on trace of the most recent
+ * records, from which rb_snapshot can take a consistent copy at any time
+ * without stopping the sender. Each record carries an extra 8-byte trailer.
+ * Requires RB_FLAG_FRAMED and RB_FLAG_SEQUENCED.
+ */
+#define RB_FLAG_RECORDER        (1u << 2)
+
 /* Create a new ring buffer.
  *  base - A pointer to the start of the region to use as the buffer.
- *  size - The size of the buffer in bytes.
+ *  size - The size of the buffer in bytes. Must be at least 2.
  * Returns NULL on failure.
  */
 ringbuffer_t *rb_new(void *base, size_t size);
 
+/* Create a new ring buffer with the given mode. Both ends of a buffer must
+ * use the same flags.
+ *  base - A pointer to the start of the region to use as the buffer.
+ *  size - The size of the region in bytes.
+ *  flags - Bitwise OR of RB_FLAG_* values.
+ * Returns NULL on failure.
+ */
+ringbuffer_t *rb_new_flags(void *base, size_t size, unsigned flags);
+
+/* Set up a region for use as a ring buffer in place, without allocating any
+ * memory. The region gets a versioned header recording its size and flags, and
+ * the position of the sender, so that either end can later attach to it with
+ * rb_attach, including after a restart. The region is cleared.
+ *  r - Handle to fill in for use by the caller.
+ *  base - A pointer to the start of the region, which must be 8-byte aligned.
+ *  size - The size of the region in bytes, including the RB_CTRL_SIZE-byte
+ *         header.
+ *  flags - Bitwise OR of RB_FLAG_* values.
+ * Returns 0 on success, -1 on failure.
+ */
+int rb_init_shared(ringbuffer_t *r, void *base, size_t size, unsigned flags);
+
+/* Attach to a region set up by rb_init_shared, possibly by another component.
+ * The handle starts from the sender's last published position, so a receiver
+ * sees only data sent after it attached and a restarted sender carries on
+ * where it left off. Handles filled in by rb_init_shared or rb_attach do not
+ * need to be destroyed.
+ *  r - Handle to fill in for use by the caller.
+ *  base - A pointer to the start of the region.
+ * Returns 0 on success, -1 if the region has not been set up or was set up by
+ * an incompatible version of this library.
+ */
+int rb_attach(ringbuffer_t *r, void *base);
+
 /* Check if ring buffer has data
  *  r - Buffer to check
  * Returns Boolean representing if ringbuffer has data.
  */
 int rb_has_data(ringbuffer_t *r);
 
-/* Send a byte.
+/* Send a byte. Not available in framed mode.
  *  r - Buffer to send via.
  *  c - Byte to send.
  */
 void rb_transmit_byte(ringbuffer_t *r, unsigned char c);
 
-/* Receive a byte.
+/* Receive a byte. Not available in framed mode.
  *  r - Buffer to read from.
  * Returns the character received. Does not return until it has received some
- * data.
+ * data, busy waiting unless wait hooks have been set with rb_set_wait_ops.
  */
 unsigned char rb_receive_byte(ringbuffer_t *r);
 
@@ -53,7 +175,9 @@ unsigned char rb_receive_byte(ringbuffer_t *r);
  */
 unsigned char rb_poll_byte(ringbuffer_t *r);
 
-/* Destroy a ring buffer and deallocate associated resources. */
+/* Destroy a ring buffer created with rb_new or rb_new_flags and deallocate
+ * associated resources.
+ */
 void rb_destroy(ringbuffer_t *r);
 
 /* Higher-level wrappers. */
@@ -74,18 +198,129 @@ size_t rb_transmit_string(ringbuffer_t *r, const char *s);
  */
 size_t rb_receive_string(ringbuffer_t *r, char *s, size_t len);
 
-/* Send an arbitrary block of data. The block cannot contain any 0 bytes.
+/* Send an arbitrary block of data. The block cannot contain any 0 bytes; any
+ * that are present are dropped. Data is copied into the buffer in bulk and
+ * made visible to the receiver in batches of up to size - 1 bytes, so the
+ * receiver never observes part of a batch.
  *  r - Buffer to send via.
  *  src - Location to read from.
  *  len - Number of bytes to send.
+ *
+ * In framed mode the block is sent as a single record and may contain 0s.
+ * Nothing is sent if the record does not fit in the buffer.
  * Returns the number of bytes sent.
  */
 size_t rb_transmit(ringbuffer_t *r, const void *src, size_t len);
 
-/* Receive an arbitrary block of data.
+/* Send a block of data gathered from several fragments, as if they had first
+ * been concatenated and passed to rb_transmit. The receiver sees all of the
+ * fragments at once or none of them, unless in byte mode they add up to more
+ * than the buffer can hold.
+ *  r - Buffer to send via.
+ *  iov - Fragments to send.
+ *  iovcnt - Number of fragments.
+ * Returns the number of bytes sent.
+ */
+size_t rb_transmitv(ringbuffer_t *r, const struct iovec *iov, int iovcnt);
+
+/* Receive an arbitrary block of data. Does not return until len bytes have
+ * been received.
  *  r - Buffer to read from.
  *  dest - Location to write bytes received into.
  *  len - Maximum number of bytes to write to destination location.
+ *
+ * In framed mode this instead waits for a single record and returns once it
+ * has been received. Any part of the record beyond len bytes is discarded.
  * Returns the number of bytes received.
  */
 size_t rb_receive(ringbuffer_t *r, void *dest, size_t len);
+
+/* Poll for new data. Identical to rb_receive, except it is non-blocking and
+ * returns whatever is available immediately, up to len bytes.
+ *  r - Buffer to read from.
+ *  dest - Location to write bytes received into.
+ *  len - Maximum number of bytes to write to destination location.
+ * Returns the number of bytes received, or -1 if no data is available.
+ */
+ssize_t rb_poll(ringbuffer_t *r, void *dest, size_t len);
+
+/* Zero-copy interface. These are only available in framed mode. */
+
+/* Reserve space for a record of len bytes, to be filled in place and then
+ * published with rb_commit. Only one reservation may be outstanding at a time.
+ *  r - Buffer to send via.
+ *  len - Length of the record in bytes.
+ *  span1, span2 - Filled in with the location of the record in the buffer.
+ * Returns 0 on success, -1 if the record does not fit in the buffer.
+ */
+int rb_reserve(ringbuffer_t *r, size_t len, rb_span_t *span1, rb_span_t *span2);
+
+/* Publish the record reserved by the last call to rb_reserve.
+ *  r - Buffer to send via.
+ */
+void rb_commit(ringbuffer_t *r);
+
+/* Get the location of the next record without copying it out of the buffer.
+ * The record stays at the head of the buffer until rb_release is called.
+ *  r - Buffer to read from.
+ *  span1, span2 - Filled in with the location of the record in the buffer.
+ * Returns 0 on success, -1 if no record is available.
+ */
+int rb_peek(ringbuffer_t *r, rb_span_t *span1, rb_span_t *span2);
+
+/* Consume the record returned by the last call to rb_peek. As there is no
+ * flow control, the sender may have reused the record's space while it was
+ * being read, in which case the caller should discard whatever it read.
+ * Only a buffer with RB_FLAG_SEQUENCED catches every such record. Without it,
+ * a record being overwritten by a write the sender has reserved but not yet
+ * committed goes unnoticed.
+ *  r - Buffer to read from.
+ * Returns -1 if the record was found to be overwritten, 0 otherwise. With
+ * RB_FLAG_SEQUENCED, 0 means the record was intact.
+ */
+int rb_release(ringbuffer_t *r);
+
+/* Get the amount of data this receiver has missed since it was created. Only
+ * available in framed mode. Without RB_FLAG_SEQUENCED, a record overwritten
+ * while it is being read may go unnoticed.
+ *  r - Buffer to read from.
+ *  loss - Filled in with the totals.
+ */
+void rb_get_loss(ringbuffer_t *r, rb_loss_t *loss);
+
+/* Set the hooks used to block while waiting for data. Both ends of a buffer
+ * should set them, the receiver for wait and the sender for notify. Once set,
+ * rb_receive, rb_receive_byte and rb_receive_string poll for a while and then
+ * block, polling for longer the more often data turns up while they do.
+ *
+ * On a buffer with a control block (framed mode, or set up by
+ * rb_init_shared), a receiver about to block sets a flag there, and the sender
+ * only calls notify when it finds the flag set. Note that this means the
+ * receiver writes to the shared region, although nothing it writes affects
+ * what the sender sends. On other buffers the sender notifies on every send.
+ *  r - Buffer to set the hooks for.
+ *  ops - Hooks to use, or NULL to go back to busy waiting.
+ */
+void rb_set_wait_ops(ringbuffer_t *r, const rb_wait_ops_t *ops);
+
+/* Take a consistent copy of the most recent records of a flight recorder,
+ * without stopping the sender. Copies as many whole records as fit, and
+ * retries if the sender overwrote any of them while they were being copied.
+ * Does not affect what rb_receive or rb_poll return next.
+ *  r - Buffer to copy from, created with RB_FLAG_RECORDER.
+ *  dest - Location to copy into. Use rb_snapshot_next to walk the records.
+ *  len - Maximum number of bytes to copy.
+ * Returns the number of bytes copied, or -1 if the buffer isn't a flight
+ * recorder or the sender kept overwriting the records being copied.
+ */
+ssize_t rb_snapshot(ringbuffer_t *r, void *dest, size_t len);
+
+/* Iterate through the records in a snapshot, oldest first.
+ *  snap - The snapshot, as filled in by rb_snapshot.
+ *  len - The length of the snapshot, as returned by rb_snapshot.
+ *  offset - Iterator state. Set to 0 before the first call.
+ *  record - Filled in with the location of the next record's payload.
+ *  seq - If not NULL, filled in with the next record's sequence number.
+ * Returns 0 on success, -1 if there are no more records.
+ */
+int rb_snapshot_next(const void *snap, size_t len, size_t *offset, rb_span_t *record, uint32_t *seq);
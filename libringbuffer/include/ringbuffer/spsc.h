@@ -0,0 +1,103 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/* A single-producer single-consumer byte ring for use between endpoints
+ * running on different cores.
+ *
+ * Unlike ringbuffer_t, this ring is flow controlled: the consumer publishes how
+ * far it has read, and the producer never overwrites data that has not been
+ * consumed. This means both ends need write access to the control block.
+ *
+ * The producer and consumer indices live on separate cache lines, are
+ * published with release stores and read with acquire loads, and each end
+ * keeps a cached copy of the other end's index so that it only touches the
+ * remote cache line when the cached value says it must.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define RB_SPSC_CACHE_LINE      64
+
+/* Shared control block. Must be zeroed with rb_spsc_init_ctrl before either
+ * end is initialised, and should be aligned to RB_SPSC_CACHE_LINE.
+ */
+typedef struct rb_spsc_ctrl {
+    uint32_t head;      /* Free-running producer index, written by the producer */
+    unsigned char pad0[RB_SPSC_CACHE_LINE - sizeof(uint32_t)];
+    uint32_t tail;      /* Free-running consumer index, written by the consumer */
+    unsigned char pad1[RB_SPSC_CACHE_LINE - sizeof(uint32_t)];
+} rb_spsc_ctrl_t;
+
+/* One end of a ring. Private to that end. */
+typedef struct rb_spsc {
+    rb_spsc_ctrl_t *ctrl;   /* The shared control block */
+    unsigned char *data;    /* The shared data area */
+    uint32_t mask;          /* Size of the data area minus one */
+    uint32_t index;         /* Our own index */
+    uint32_t cached;        /* Last value seen of the other end's index */
+} rb_spsc_t;
+
+/* Initialise the shared control block.
+ *  ctrl - The control block to clear.
+ */
+void rb_spsc_init_ctrl(rb_spsc_ctrl_t *ctrl);
+
+/* Initialise the producer end of a ring.
+ *  r - Handle to fill in for the producer.
+ *  ctrl - A pointer to the shared control block.
+ *  data - A pointer to the shared data area.
+ *  size - The size of the data area. Must be a power of 2 no larger than 2^31.
+ * Returns 0 on success, -1 on failure.
+ */
+int rb_spsc_init_producer(rb_spsc_t *r, rb_spsc_ctrl_t *ctrl, void *data, size_t size);
+
+/* Initialise the consumer end of a ring.
+ *  r - Handle to fill in for the consumer.
+ *  ctrl - A pointer to the shared control block.
+ *  data - A pointer to the shared data area.
+ *  size - The size of the data area. Must be a power of 2 no larger than 2^31.
+ * Returns 0 on success, -1 on failure.
+ */
+int rb_spsc_init_consumer(rb_spsc_t *r, rb_spsc_ctrl_t *ctrl, void *data, size_t size);
+
+/* Write as much of a block of data as there is room for. Does not block.
+ *  r - The producer end.
+ *  src - Location to read from.
+ *  len - Number of bytes to write.
+ * Returns the number of bytes written.
+ */
+size_t rb_spsc_write(rb_spsc_t *r, const void *src, size_t len);
+
+/* Read as much data as is available, up to len bytes. Does not block.
+ *  r - The consumer end.
+ *  dest - Location to write into.
+ *  len - Maximum number of bytes to read.
+ * Returns the number of bytes read.
+ */
+size_t rb_spsc_read(rb_spsc_t *r, void *dest, size_t len);
+
+/* Get the number of bytes that can currently be read. The producer's index
+ * is only looked at if the cached copy of it gives less than len bytes, so
+ * the result may be lower than the amount of data really in the ring, but it
+ * is accurate whenever it is less than len.
+ *  r - The consumer end.
+ *  len - Number of bytes the caller wants to read.
+ * Returns the number of bytes available.
+ */
+size_t rb_spsc_readable(rb_spsc_t *r, size_t len);
+
+/* Get the number of bytes that can currently be written. The consumer's
+ * index is only looked at if the cached copy of it leaves less than len bytes
+ * free, so the result may be lower than the true free space, but it is
+ * accurate whenever it is less than len.
+ *  r - The producer end.
+ *  len - Number of bytes the caller wants to write.
+ * Returns the number of bytes of free space.
+ */
+size_t rb_spsc_writable(rb_spsc_t *r, size_t len);
@@ -6,35 +6,581 @@
 
 #include <assert.h>
 #include <ringbuffer/ringbuffer.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
-struct ringbuffer {
-    volatile unsigned char *base;
-    size_t size;
-    off_t offset;
+/* In framed mode, and in any mode when the region is set up with
+ * rb_init_shared, the region starts with a control block, padded out to a
+ * cache line, followed by the data area. The data area holds a sequence of
+ * records, each a header followed by the payload padded to RB_RECORD_ALIGN.
+ * A record is published by advancing the commit position past it; nothing
+ * the receiver does is visible to the sender.
+ *
+ * Every record is stamped with a sequence number, from which the receiver can
+ * count how many records it missed. With RB_FLAG_SEQUENCED the sender also
+ * publishes the position of the oldest record it has not yet started to
+ * overwrite, and moves it on before overwriting anything, so the receiver can
+ * tell whether what it read was intact and where to pick up again if not.
+ *
+ * The only field the receiver writes is kept on a cache line of its own, so
+ * that a receiver going to sleep doesn't take the line the sender publishes
+ * through away from it.
+ */
+#define RB_CACHE_LINE       64
+
+struct rb_ctrl {
+    uint32_t magic;                 /* RB_MAGIC once set up by rb_init_shared */
+    uint16_t version;               /* Layout version, RB_VERSION */
+    uint16_t flags;                 /* Flags the region was set up with */
+    uint64_t size;                  /* Size of the whole region */
+    uint64_t commit;                /* Position following the last published record,
+                                     * or the sender's slot in byte mode */
+    uint64_t tail;                  /* Position of the oldest intact record */
+    uint32_t seq;                   /* Sequence number of the next record */
+    uint32_t waiting __attribute__((aligned(RB_CACHE_LINE)));
+                                    /* Set by a receiver about to block */
+};
+
+struct rb_record {
+    uint32_t len;                   /* Length of the payload in bytes */
+    uint32_t seq;                   /* Sequence number of the record */
+};
+
+/* With RB_FLAG_RECORDER each record also ends with a trailer, so that the
+ * records can be walked backwards from the commit position.
+ */
+struct rb_trailer {
+    uint32_t size;                  /* Space taken up by the whole record */
+    uint32_t seq;                   /* Sequence number of the record */
 };
 
+#define RB_MAGIC            0x52425546
+#define RB_VERSION          2
+
+/* Bounds on the number of times a receiver with wait hooks polls for data
+ * before blocking.
+ */
+#define RB_SPIN_MIN         16
+#define RB_SPIN_DEFAULT     256
+#define RB_SPIN_MAX         16384
+
+/* Number of times rb_snapshot retries when the sender overwrites the records
+ * it is copying before giving up.
+ */
+#define RB_SNAPSHOT_TRIES   8
+#define RB_RECORD_ALIGN     8
+#define RB_FLAGS_VALID      (RB_FLAG_FRAMED | RB_FLAG_SEQUENCED | RB_FLAG_RECORDER)
+
+/* The bulk paths below scan for the zero sentinel a machine word at a time.
+ * A word contains a zero byte iff subtracting 0x01 from every byte borrows
+ * into a byte whose top bit was previously clear.
+ */
+typedef unsigned long __attribute__((__may_alias__)) rb_word_t;
+
+#define RB_WORD_SIZE        sizeof(rb_word_t)
+#define RB_WORD_ONES        ((rb_word_t)-1 / 0xff)
+#define RB_WORD_HIGHS       (RB_WORD_ONES * 0x80)
+#define RB_WORD_HAS_ZERO(w) ((((w) - RB_WORD_ONES) & ~(w) & RB_WORD_HIGHS) != 0)
+
+/* A run of bytes staged into the buffer behind the current write slot. The
+ * slot at start keeps its zero sentinel until the whole run is published, so
+ * the receiver never observes a partially written batch.
+ */
+typedef struct rb_batch {
+    off_t start;            /* Slot that will hold the first byte */
+    off_t cur;              /* Next slot to write */
+    size_t len;             /* Bytes staged so far, including the first */
+    unsigned char first;    /* First byte, withheld until publication */
+} rb_batch_t;
+
+/* Returns the length of the run of non-zero bytes at the start of p, looking
+ * at no more than len bytes.
+ */
+static size_t rb_nonzero_span(const unsigned char *p, size_t len)
+{
+    size_t n = 0;
+
+    while (n < len && ((uintptr_t)(p + n) & (RB_WORD_SIZE - 1)) != 0) {
+        if (p[n] == 0) {
+            return n;
+        }
+        n++;
+    }
+
+    while (len - n >= RB_WORD_SIZE && !RB_WORD_HAS_ZERO(*(const rb_word_t *)(p + n))) {
+        n += RB_WORD_SIZE;
+    }
+
+    while (n < len && p[n] != 0) {
+        n++;
+    }
+    return n;
+}
+
+static inline size_t rb_min(size_t a, size_t b)
+{
+    return a < b ? a : b;
+}
+
+static off_t rb_advance(ringbuffer_t *r, off_t offset, size_t len)
+{
+    size_t next = (size_t)offset + len;
+    if (next >= r->size) {
+        next -= r->size;
+    }
+    return (off_t)next;
+}
+
+static inline int rb_is_framed(ringbuffer_t *r)
+{
+    return (r->flags & RB_FLAG_FRAMED) != 0;
+}
+
+/* Copy len bytes into the buffer at offset, as at most two contiguous spans. */
+static void rb_copy_in(ringbuffer_t *r, off_t offset, const unsigned char *src, size_t len)
+{
+    unsigned char *base = (unsigned char *)r->base;
+    size_t first = r->size - offset;
+
+    if (len <= first) {
+        memcpy(base + offset, src, len);
+    } else {
+        memcpy(base + offset, src, first);
+        memcpy(base, src + first, len - first);
+    }
+}
+
+/* With a control block, let whoever attaches next know where the sender is. */
+static inline void rb_publish_offset(ringbuffer_t *r)
+{
+    if (r->ctrl != NULL) {
+        __atomic_store_n(&r->ctrl->commit, (uint64_t)r->offset, __ATOMIC_RELAXED);
+    }
+}
+
+/* Wake the receiver if it has said it is about to block. Without a control
+ * block we have no way of telling, and have to wake it every time.
+ */
+static inline void rb_notify(ringbuffer_t *r)
+{
+    if (r->wait_ops.notify == NULL) {
+        return;
+    }
+
+    if (r->ctrl != NULL) {
+        /* Pairs with the fence in rb_wait_for_data: either the receiver sees
+         * what we just published, or we see that it is waiting.
+         */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&r->ctrl->waiting, __ATOMIC_RELAXED) == 0 ||
+            __atomic_exchange_n(&r->ctrl->waiting, 0, __ATOMIC_RELAXED) == 0) {
+            return;
+        }
+    }
+    r->wait_ops.notify(r->wait_ops.cookie);
+}
+
+static void rb_batch_begin(ringbuffer_t *r, rb_batch_t *b)
+{
+    b->start = r->offset;
+    b->cur = r->offset;
+    b->len = 0;
+}
+
+/* Stage bytes from src into the batch, dropping any 0s. A batch never covers
+ * more than size - 1 slots so that its trailing sentinel never lands on its
+ * own first slot.
+ * Returns the number of bytes consumed from src.
+ */
+static size_t rb_batch_append(ringbuffer_t *r, rb_batch_t *b, const unsigned char *src, size_t len)
+{
+    size_t used = 0;
+
+    while (used < len && b->len < r->size - 1) {
+        size_t room = r->size - 1 - b->len;
+        size_t n = rb_nonzero_span(src + used, rb_min(len - used, room));
+        const unsigned char *s = src + used;
+
+        if (n == 0) {
+            /* We can't send 0s. */
+            used++;
+            continue;
+        }
+        used += n;
+
+        if (b->len == 0) {
+            b->first = *s;
+            b->cur = rb_advance(r, b->cur, 1);
+            b->len = 1;
+            s++;
+            n--;
+        }
+        rb_copy_in(r, b->cur, s, n);
+        b->cur = rb_advance(r, b->cur, n);
+        b->len += n;
+    }
+    return used;
+}
+
+/* Make a staged batch visible to the receiver. The new sentinel is written
+ * before the first byte replaces the old one, so the receiver sees either
+ * none or all of the batch.
+ */
+static void rb_batch_publish(ringbuffer_t *r, rb_batch_t *b)
+{
+    if (b->len == 0) {
+        return;
+    }
+    r->base[b->cur] = 0;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    r->base[b->start] = b->first;
+    r->offset = b->cur;
+    rb_publish_offset(r);
+    rb_notify(r);
+}
+
+/* Space taken up in the data area by a record with a payload of len bytes. */
+static inline size_t rb_record_size(unsigned flags, size_t len)
+{
+    size_t size = sizeof(struct rb_record) + ((len + RB_RECORD_ALIGN - 1) & ~(size_t)(RB_RECORD_ALIGN - 1));
+    if (flags & RB_FLAG_RECORDER) {
+        size += sizeof(struct rb_trailer);
+    }
+    return size;
+}
+
+static inline uint64_t rb_load_commit(ringbuffer_t *r)
+{
+    return __atomic_load_n(&r->ctrl->commit, __ATOMIC_ACQUIRE);
+}
+
+static inline uint64_t rb_load_tail(ringbuffer_t *r)
+{
+    return __atomic_load_n(&r->ctrl->tail, __ATOMIC_ACQUIRE);
+}
+
+static inline int rb_is_sequenced(ringbuffer_t *r)
+{
+    return (r->flags & RB_FLAG_SEQUENCED) != 0;
+}
+
+/* Move our position to pos, discarding anything before it. */
+static void rb_seek(ringbuffer_t *r, uint64_t pos)
+{
+    r->pos = pos;
+    r->offset = (off_t)(pos % r->size);
+}
+
+/* The sender has overwritten data we had not read yet. Skip to the oldest data
+ * that is still intact if the sender tells us where that is, or else to the
+ * newest, and account for what was skipped.
+ */
+static void rb_skip_lost(ringbuffer_t *r, uint64_t commit)
+{
+    uint64_t pos = commit;
+
+    if (rb_is_sequenced(r)) {
+        uint64_t tail = rb_load_tail(r);
+        if ((int64_t)(tail - r->pos) > 0) {
+            pos = tail;
+        }
+    }
+    r->loss.bytes += pos - r->pos;
+    rb_seek(r, pos);
+}
+
+/* Move the tail past every record that writing total more bytes will
+ * overwrite, and publish it before any of them are touched.
+ */
+static void rb_reclaim(ringbuffer_t *r, size_t total)
+{
+    uint64_t tail = r->tail;
+
+    while (r->pos + total - tail > r->size) {
+        const struct rb_record *old = (const struct rb_record *)(r->base + r->tail_offset);
+        size_t n = rb_record_size(r->flags, old->len);
+        tail += n;
+        r->tail_offset = rb_advance(r, r->tail_offset, n);
+    }
+
+    if (tail != r->tail) {
+        r->tail = tail;
+        __atomic_store_n(&r->ctrl->tail, tail, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+}
+
+/* Describe the len bytes of the data area starting at offset. */
+static void rb_spans(ringbuffer_t *r, off_t offset, size_t len, rb_span_t *span1, rb_span_t *span2)
+{
+    size_t first = rb_min(len, r->size - offset);
+
+    span1->base = (void *)(r->base + offset);
+    span1->len = first;
+    span2->base = (void *)r->base;
+    span2->len = len - first;
+}
+
+static size_t rb_transmitv_record(ringbuffer_t *r, const struct iovec *iov, int iovcnt)
+{
+    rb_span_t span[2];
+    size_t len = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    if (rb_reserve(r, len, &span[0], &span[1]) != 0) {
+        return 0;
+    }
+
+    /* Lay the fragments out one after the other across the two spans. */
+    int cur = 0;
+    size_t used = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        const unsigned char *s = (const unsigned char *)iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left > 0) {
+            if (used == span[cur].len) {
+                cur++;
+                used = 0;
+            }
+            size_t n = rb_min(left, span[cur].len - used);
+            memcpy((unsigned char *)span[cur].base + used, s, n);
+            used += n;
+            s += n;
+            left -= n;
+        }
+    }
+    rb_commit(r);
+    return len;
+}
+
+static ssize_t rb_poll_record(ringbuffer_t *r, void *dest, size_t len)
+{
+    rb_span_t span1, span2;
+
+    if (rb_peek(r, &span1, &span2) != 0) {
+        return -1;
+    }
+
+    size_t n = rb_min(span1.len, len);
+    memcpy(dest, span1.base, n);
+    if (n < len) {
+        size_t rest = rb_min(span2.len, len - n);
+        memcpy((unsigned char *)dest + n, span2.base, rest);
+        n += rest;
+    }
+
+    if (rb_release(r) != 0) {
+        /* The sender overwrote the record while we were copying it. */
+        return -1;
+    }
+    return (ssize_t)n;
+}
+
+static ssize_t rb_poll_bytes(ringbuffer_t *r, void *dest, size_t len)
+{
+    size_t received = 0;
+    unsigned char *d = (unsigned char *)dest;
+
+    if (r->base[r->offset] == 0) {
+        return -1;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    /* Take at most one span up to the end of the buffer and one after it. */
+    for (int i = 0; i < 2 && received < len; i++) {
+        const unsigned char *s = (const unsigned char *)r->base + r->offset;
+        size_t n = rb_nonzero_span(s, rb_min(len - received, r->size - r->offset));
+        memcpy(d + received, s, n);
+        received += n;
+        r->offset = rb_advance(r, r->offset, n);
+        if (r->offset != 0) {
+            break;
+        }
+    }
+    return (ssize_t)received;
+}
+
+/* Wait until there is data to read. Without wait hooks this is a busy wait.
+ * With them, we poll for a while and then block, adjusting how long we poll
+ * for by whether data tends to turn up before we give up. Data that is
+ * already there when we are called says nothing about that, so it leaves the
+ * spin count alone.
+ */
+static void rb_wait_for_data(ringbuffer_t *r)
+{
+    if (r->wait_ops.wait == NULL) {
+        while (!rb_has_data(r));
+        return;
+    }
+
+    for (unsigned i = 0; i < r->spin; i++) {
+        if (rb_has_data(r)) {
+            if (i > 0 && r->spin < RB_SPIN_MAX) {
+                r->spin *= 2;
+            }
+            return;
+        }
+    }
+    if (r->spin > RB_SPIN_MIN) {
+        r->spin /= 2;
+    }
+
+    while (!rb_has_data(r)) {
+        if (r->ctrl != NULL) {
+            /* Tell the sender to wake us, then check again in case it
+             * published before it could see that.
+             */
+            __atomic_store_n(&r->ctrl->waiting, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (rb_has_data(r)) {
+                break;
+            }
+        }
+        r->wait_ops.wait(r->wait_ops.cookie);
+    }
+}
+
 ringbuffer_t *rb_new(void *base, size_t size)
 {
+    return rb_new_flags(base, size, 0);
+}
+
+static int rb_check(void *base, size_t size, unsigned flags, size_t ctrl_size)
+{
+    if ((flags & ~RB_FLAGS_VALID) != 0) {
+        return -1;
+    }
+
+    if ((flags & RB_FLAG_SEQUENCED) && !(flags & RB_FLAG_FRAMED)) {
+        return -1;
+    }
+
+    if ((flags & RB_FLAG_RECORDER) && !(flags & RB_FLAG_SEQUENCED)) {
+        return -1;
+    }
+
+    if (ctrl_size != 0 && ((uintptr_t)base & (RB_RECORD_ALIGN - 1)) != 0) {
+        /* The control block needs to be aligned. */
+        return -1;
+    }
+
+    if (flags & RB_FLAG_FRAMED) {
+        /* We need room for at least one non-empty record. */
+        if (size < ctrl_size + rb_record_size(flags, 1)) {
+            return -1;
+        }
+    } else if (size < ctrl_size + 2) {
+        /* We need room for at least one byte and the sentinel following it. */
+        return -1;
+    }
+    return 0;
+}
+
+/* Fill in a handle for a region that has already been checked. Both ends start
+ * from whatever the sender last published.
+ */
+static void rb_setup(ringbuffer_t *r, void *base, size_t size, unsigned flags, size_t ctrl_size)
+{
+    r->flags = flags;
+    r->ctrl = ctrl_size != 0 ? (struct rb_ctrl *)base : NULL;
+    r->base = (volatile unsigned char *)base + ctrl_size;
+    r->size = size - ctrl_size;
+    r->reserved = 0;
+    r->peeked = 0;
+    r->loss.bytes = 0;
+    r->loss.records = 0;
+    r->wait_ops.wait = NULL;
+    r->wait_ops.notify = NULL;
+    r->wait_ops.cookie = NULL;
+    r->spin = RB_SPIN_DEFAULT;
+
+    if (flags & RB_FLAG_FRAMED) {
+        r->size &= ~(size_t)(RB_RECORD_ALIGN - 1);
+        rb_seek(r, rb_load_commit(r));
+        r->seq = __atomic_load_n(&r->ctrl->seq, __ATOMIC_RELAXED);
+        r->tail = rb_load_tail(r);
+        r->tail_offset = (off_t)(r->tail % r->size);
+    } else {
+        r->pos = 0;
+        r->offset = 0;
+        if (r->ctrl != NULL) {
+            r->offset = (off_t)(rb_load_commit(r) % r->size);
+        }
+    }
+}
+
+ringbuffer_t *rb_new_flags(void *base, size_t size, unsigned flags)
+{
+    size_t ctrl_size = (flags & RB_FLAG_FRAMED) ? RB_CTRL_SIZE : 0;
+
+    if (rb_check(base, size, flags, ctrl_size) != 0) {
+        return NULL;
+    }
+
     ringbuffer_t *r = malloc(sizeof(*r));
     if (r == NULL) {
         return NULL;
     }
 
-    r->base = (volatile unsigned char *)base;
-    r->size = size;
-    r->offset = 0;
+    rb_setup(r, base, size, flags, ctrl_size);
     return r;
 }
 
+int rb_init_shared(ringbuffer_t *r, void *base, size_t size, unsigned flags)
+{
+    if (rb_check(base, size, flags, RB_CTRL_SIZE) != 0) {
+        return -1;
+    }
+
+    /* Everything else must be in place before the magic number says the
+     * region is ready to be attached to.
+     */
+    memset(base, 0, size);
+    struct rb_ctrl *ctrl = (struct rb_ctrl *)base;
+    ctrl->version = RB_VERSION;
+    ctrl->flags = (uint16_t)flags;
+    ctrl->size = size;
+    __atomic_store_n(&ctrl->magic, RB_MAGIC, __ATOMIC_RELEASE);
+
+    rb_setup(r, base, size, flags, RB_CTRL_SIZE);
+    return 0;
+}
+
+int rb_attach(ringbuffer_t *r, void *base)
+{
+    const struct rb_ctrl *ctrl = (const struct rb_ctrl *)base;
+
+    if (((uintptr_t)base & (RB_RECORD_ALIGN - 1)) != 0 ||
+        __atomic_load_n(&ctrl->magic, __ATOMIC_ACQUIRE) != RB_MAGIC ||
+        ctrl->version != RB_VERSION) {
+        return -1;
+    }
+
+    if (ctrl->size > SIZE_MAX || rb_check(base, (size_t)ctrl->size, ctrl->flags, RB_CTRL_SIZE) != 0) {
+        return -1;
+    }
+
+    rb_setup(r, base, (size_t)ctrl->size, ctrl->flags, RB_CTRL_SIZE);
+    return 0;
+}
+
 int rb_has_data(ringbuffer_t *r)
 {
-    return (r->base[r->offset] == 0);
+    if (rb_is_framed(r)) {
+        return rb_load_commit(r) != r->pos;
+    }
+    return (r->base[r->offset] != 0);
 }
 
 void rb_transmit_byte(ringbuffer_t *r, unsigned char c)
 {
+    assert(!rb_is_framed(r));
+
     /* We can't send 0s. */
     if (c == 0) {
         return;
@@ -50,10 +596,14 @@ void rb_transmit_byte(ringbuffer_t *r, unsigned char c)
     /* Write the character and increment to the next slot for next time. */
     r->base[r->offset] = c;
     r->offset = next;
+    rb_publish_offset(r);
+    rb_notify(r);
 }
 
 unsigned char rb_poll_byte(ringbuffer_t *r)
 {
+    assert(!rb_is_framed(r));
+
     if (r->base[r->offset] != 0) {
 
         /* Read the data that's now available and increment to the next slot.
@@ -70,8 +620,9 @@ unsigned char rb_receive_byte(ringbuffer_t *r)
 {
     unsigned char c;
 
-    /* Busy wait for available data. */
-    while ((c = rb_poll_byte(r)) == 0);
+    while ((c = rb_poll_byte(r)) == 0) {
+        rb_wait_for_data(r);
+    }
 
     return c;
 }
@@ -83,46 +634,304 @@ void rb_destroy(ringbuffer_t *r)
 
 size_t rb_transmit_string(ringbuffer_t *r, const char *s)
 {
-    size_t sent = 0;
-    while (*s != '\0') {
-        rb_transmit_byte(r, (unsigned char)*s);
-        sent++;
-        s++;
-    }
-    return sent;
+    return rb_transmit(r, s, strlen(s));
 }
 
 size_t rb_receive_string(ringbuffer_t *r, char *s, size_t len)
 {
-    size_t received = 0;
-    while (len > 0) {
-        *s = (char)rb_receive_byte(r);
-        s++;
-        len--;
-    }
-    return received;
+    return rb_receive(r, s, len);
 }
 
 size_t rb_transmit(ringbuffer_t *r, const void *src, size_t len)
 {
+    struct iovec iov = { .iov_base = (void *)src, .iov_len = len };
+    return rb_transmitv(r, &iov, 1);
+}
+
+size_t rb_transmitv(ringbuffer_t *r, const struct iovec *iov, int iovcnt)
+{
+    if (rb_is_framed(r)) {
+        return rb_transmitv_record(r, iov, iovcnt);
+    }
+
+    /* Stage every fragment into one batch, only publishing early if the
+     * batch fills the buffer.
+     */
     size_t sent = 0;
-    unsigned char *s = (unsigned char *)src;
-    while (len > 0) {
-        rb_transmit_byte(r, *s);
-        s++;
-        len--;
+    rb_batch_t b;
+    rb_batch_begin(r, &b);
+    for (int i = 0; i < iovcnt; i++) {
+        const unsigned char *s = (const unsigned char *)iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        while (len > 0) {
+            size_t used = rb_batch_append(r, &b, s, len);
+            s += used;
+            len -= used;
+            if (len > 0) {
+                rb_batch_publish(r, &b);
+                sent += b.len;
+                rb_batch_begin(r, &b);
+            }
+        }
     }
+    rb_batch_publish(r, &b);
+    sent += b.len;
     return sent;
 }
 
-size_t rb_receive_data(ringbuffer_t *r, void *dest, size_t len)
+size_t rb_receive(ringbuffer_t *r, void *dest, size_t len)
 {
+    if (rb_is_framed(r)) {
+        ssize_t n;
+
+        while ((n = rb_poll_record(r, dest, len)) < 0) {
+            rb_wait_for_data(r);
+        }
+
+        return (size_t)n;
+    }
+
     size_t received = 0;
     unsigned char *d = (unsigned char *)dest;
-    while (len > 0) {
-        *d = rb_receive_byte(r);
-        d++;
-        len--;
+    while (received < len) {
+        /* Wait for the next batch, then take as much of it as is contiguous
+         * in the buffer.
+         */
+        rb_wait_for_data(r);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        const unsigned char *s = (const unsigned char *)r->base + r->offset;
+        size_t n = rb_nonzero_span(s, rb_min(len - received, r->size - r->offset));
+        memcpy(d + received, s, n);
+        received += n;
+        r->offset = rb_advance(r, r->offset, n);
     }
     return received;
 }
+
+ssize_t rb_poll(ringbuffer_t *r, void *dest, size_t len)
+{
+    if (rb_is_framed(r)) {
+        return rb_poll_record(r, dest, len);
+    }
+    return rb_poll_bytes(r, dest, len);
+}
+
+int rb_reserve(ringbuffer_t *r, size_t len, rb_span_t *span1, rb_span_t *span2)
+{
+    /* Bound len first, so that neither the record size nor the length in
+     * the header can wrap.
+     */
+    if (!rb_is_framed(r) || r->reserved != 0 || len > UINT32_MAX || len > r->size) {
+        return -1;
+    }
+    size_t total = rb_record_size(r->flags, len);
+    if (total > r->size) {
+        return -1;
+    }
+
+    if (rb_is_sequenced(r)) {
+        rb_reclaim(r, total);
+    }
+
+    /* Records are aligned and the data area is a multiple of the alignment,
+     * so the header itself never wraps.
+     */
+    struct rb_record *hdr = (struct rb_record *)(r->base + r->offset);
+    hdr->len = (uint32_t)len;
+    hdr->seq = r->seq;
+
+    if (r->flags & RB_FLAG_RECORDER) {
+        struct rb_trailer *trailer = (struct rb_trailer *)(r->base +
+                                                           rb_advance(r, r->offset, total - sizeof(*trailer)));
+        trailer->size = (uint32_t)total;
+        trailer->seq = r->seq;
+    }
+
+    rb_spans(r, rb_advance(r, r->offset, sizeof(*hdr)), len, span1, span2);
+    r->reserved = total;
+    return 0;
+}
+
+void rb_commit(ringbuffer_t *r)
+{
+    assert(r->reserved != 0);
+
+    r->pos += r->reserved;
+    r->offset = rb_advance(r, r->offset, r->reserved);
+    r->reserved = 0;
+    r->seq++;
+    __atomic_store_n(&r->ctrl->seq, r->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->ctrl->commit, r->pos, __ATOMIC_RELEASE);
+    rb_notify(r);
+}
+
+int rb_peek(ringbuffer_t *r, rb_span_t *span1, rb_span_t *span2)
+{
+    if (!rb_is_framed(r)) {
+        return -1;
+    }
+
+    uint64_t commit = rb_load_commit(r);
+    if (commit == r->pos) {
+        return -1;
+    }
+
+    if (commit - r->pos > r->size ||
+        (rb_is_sequenced(r) && (int64_t)(rb_load_tail(r) - r->pos) > 0)) {
+        /* The sender has lapped us. */
+        rb_skip_lost(r, commit);
+        if (commit == r->pos) {
+            return -1;
+        }
+    }
+
+    /* The length is checked before working out the size of the record, as
+     * a length the sender is in the middle of overwriting could make it wrap.
+     */
+    const struct rb_record *hdr = (const struct rb_record *)(r->base + r->offset);
+    size_t len = hdr->len;
+    size_t total;
+    if (len > commit - r->pos || (total = rb_record_size(r->flags, len)) > commit - r->pos) {
+        /* A header that doesn't fit in the published data can only be the
+         * result of the sender overwriting it under us.
+         */
+        rb_skip_lost(r, commit);
+        return -1;
+    }
+
+    /* Count the records we missed. Anything that looks like a step backwards
+     * is left alone, as it can only come from a header the sender is in the
+     * middle of overwriting, which rb_release will catch.
+     */
+    uint32_t gap = hdr->seq - r->seq;
+    if (gap != 0 && gap < (1u << 31)) {
+        r->loss.records += gap;
+    }
+    r->seq = hdr->seq + 1;
+
+    rb_spans(r, rb_advance(r, r->offset, sizeof(*hdr)), len, span1, span2);
+    r->peeked = total;
+    return 0;
+}
+
+int rb_release(ringbuffer_t *r)
+{
+    assert(r->peeked != 0);
+
+    uint64_t start = r->pos;
+    r->pos += r->peeked;
+    r->offset = rb_advance(r, r->offset, r->peeked);
+    r->peeked = 0;
+
+    /* Make sure we finished reading the record before checking whether the
+     * sender has since moved far enough to have reused its space. Only a
+     * sequenced sender tells us before it starts writing.
+     */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t commit = rb_load_commit(r);
+    if (commit - start > r->size ||
+        (rb_is_sequenced(r) && (int64_t)(rb_load_tail(r) - start) > 0)) {
+        r->loss.records++;
+        r->loss.bytes += r->pos - start;
+        if (commit - r->pos > r->size ||
+            (rb_is_sequenced(r) && (int64_t)(rb_load_tail(r) - r->pos) > 0)) {
+            rb_skip_lost(r, commit);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+void rb_get_loss(ringbuffer_t *r, rb_loss_t *loss)
+{
+    *loss = r->loss;
+}
+
+void rb_set_wait_ops(ringbuffer_t *r, const rb_wait_ops_t *ops)
+{
+    if (ops == NULL) {
+        r->wait_ops.wait = NULL;
+        r->wait_ops.notify = NULL;
+        r->wait_ops.cookie = NULL;
+    } else {
+        r->wait_ops = *ops;
+    }
+}
+
+ssize_t rb_snapshot(ringbuffer_t *r, void *dest, size_t len)
+{
+    if (!(r->flags & RB_FLAG_RECORDER)) {
+        return -1;
+    }
+
+    for (int tries = 0; tries < RB_SNAPSHOT_TRIES; tries++) {
+        uint64_t commit = rb_load_commit(r);
+        uint64_t tail = rb_load_tail(r);
+
+        /* Walk back from the newest record for as long as the records fit.
+         * Only trailers of records we go on to copy are used, so a trailer
+         * the sender was overwriting is caught by the check below.
+         */
+        uint64_t start = commit;
+        off_t offset = (off_t)(commit % r->size);
+        while ((int64_t)(start - tail) > 0) {
+            off_t at = offset >= (off_t)sizeof(struct rb_trailer) ? offset : offset + (off_t)r->size;
+            const struct rb_trailer *trailer = (const struct rb_trailer *)(r->base + at - sizeof(*trailer));
+            size_t size = trailer->size;
+            if (size < rb_record_size(r->flags, 0) || size > start - tail || size > len - (commit - start)) {
+                break;
+            }
+            start -= size;
+            offset = at - (off_t)size;
+            if (offset < 0) {
+                offset += r->size;
+            }
+        }
+
+        size_t n = (size_t)(commit - start);
+        size_t first = rb_min(n, r->size - offset);
+        memcpy(dest, (const unsigned char *)r->base + offset, first);
+        memcpy((unsigned char *)dest + first, (const unsigned char *)r->base, n - first);
+
+        /* The copy is good if the sender hadn't started overwriting any of it
+         * by the time we finished.
+         */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if ((int64_t)(rb_load_tail(r) - start) <= 0) {
+            return (ssize_t)n;
+        }
+    }
+    return -1;
+}
+
+int rb_snapshot_next(const void *snap, size_t len, size_t *offset, rb_span_t *record, uint32_t *seq)
+{
+    const unsigned char *s = (const unsigned char *)snap;
+    const size_t overhead = rb_record_size(RB_FLAG_RECORDER, 0);
+
+    if (*offset >= len || len - *offset < overhead) {
+        return -1;
+    }
+
+    struct rb_record hdr;
+    memcpy(&hdr, s + *offset, sizeof(hdr));
+    /* Check the length against the snapshot before sizing the record, as a
+     * header the sender was overwriting could make the size wrap.
+     */
+    if (hdr.len > len - *offset - overhead) {
+        return -1;
+    }
+    size_t size = rb_record_size(RB_FLAG_RECORDER, hdr.len);
+    if (size > len - *offset) {
+        return -1;
+    }
+
+    record->base = (void *)(s + *offset + sizeof(hdr));
+    record->len = hdr.len;
+    if (seq != NULL) {
+        *seq = hdr.seq;
+    }
+    *offset += size;
+    return 0;
+}
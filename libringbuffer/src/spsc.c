@@ -0,0 +1,132 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <ringbuffer/spsc.h>
+#include <stdint.h>
+#include <string.h>
+
+static inline uint32_t rb_spsc_load(uint32_t *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void rb_spsc_store(uint32_t *p, uint32_t v)
+{
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static int rb_spsc_init(rb_spsc_t *r, rb_spsc_ctrl_t *ctrl, void *data, size_t size)
+{
+    if (size == 0 || (size & (size - 1)) != 0 || size > (1u << 31)) {
+        return -1;
+    }
+    r->ctrl = ctrl;
+    r->data = (unsigned char *)data;
+    r->mask = (uint32_t)(size - 1);
+    return 0;
+}
+
+void rb_spsc_init_ctrl(rb_spsc_ctrl_t *ctrl)
+{
+    memset(ctrl, 0, sizeof(*ctrl));
+}
+
+int rb_spsc_init_producer(rb_spsc_t *r, rb_spsc_ctrl_t *ctrl, void *data, size_t size)
+{
+    if (rb_spsc_init(r, ctrl, data, size) != 0) {
+        return -1;
+    }
+    r->index = __atomic_load_n(&ctrl->head, __ATOMIC_RELAXED);
+    r->cached = rb_spsc_load(&ctrl->tail);
+    return 0;
+}
+
+int rb_spsc_init_consumer(rb_spsc_t *r, rb_spsc_ctrl_t *ctrl, void *data, size_t size)
+{
+    if (rb_spsc_init(r, ctrl, data, size) != 0) {
+        return -1;
+    }
+    r->index = __atomic_load_n(&ctrl->tail, __ATOMIC_RELAXED);
+    r->cached = rb_spsc_load(&ctrl->head);
+    return 0;
+}
+
+size_t rb_spsc_writable(rb_spsc_t *r, size_t len)
+{
+    uint32_t size = r->mask + 1;
+    size_t space = size - (r->index - r->cached);
+
+    /* Only look at the consumer's index when our cached copy says there
+     * isn't room for what the caller wants to write.
+     */
+    if (space < len) {
+        r->cached = rb_spsc_load(&r->ctrl->tail);
+        space = size - (r->index - r->cached);
+    }
+    return space;
+}
+
+size_t rb_spsc_readable(rb_spsc_t *r, size_t len)
+{
+    size_t avail = r->cached - r->index;
+
+    /* Only look at the producer's index when our cached copy says there
+     * is less data than the caller wants to read.
+     */
+    if (avail < len) {
+        r->cached = rb_spsc_load(&r->ctrl->head);
+        avail = r->cached - r->index;
+    }
+    return avail;
+}
+
+size_t rb_spsc_write(rb_spsc_t *r, const void *src, size_t len)
+{
+    uint32_t size = r->mask + 1;
+    size_t space = size - (r->index - r->cached);
+
+    if (space < len) {
+        r->cached = rb_spsc_load(&r->ctrl->tail);
+        space = size - (r->index - r->cached);
+    }
+    size_t n = len < space ? len : space;
+    if (n == 0) {
+        return 0;
+    }
+
+    uint32_t offset = r->index & r->mask;
+    size_t first = n < size - offset ? n : size - offset;
+    memcpy(r->data + offset, src, first);
+    memcpy(r->data, (const unsigned char *)src + first, n - first);
+
+    r->index += (uint32_t)n;
+    rb_spsc_store(&r->ctrl->head, r->index);
+    return n;
+}
+
+size_t rb_spsc_read(rb_spsc_t *r, void *dest, size_t len)
+{
+    uint32_t size = r->mask + 1;
+    size_t avail = r->cached - r->index;
+
+    if (avail < len) {
+        r->cached = rb_spsc_load(&r->ctrl->head);
+        avail = r->cached - r->index;
+    }
+    size_t n = len < avail ? len : avail;
+    if (n == 0) {
+        return 0;
+    }
+
+    uint32_t offset = r->index & r->mask;
+    size_t first = n < size - offset ? n : size - offset;
+    memcpy(dest, r->data + offset, first);
+    memcpy((unsigned char *)dest + first, r->data, n - first);
+
+    r->index += (uint32_t)n;
+    rb_spsc_store(&r->ctrl->tail, r->index);
+    return n;
+}
@@ -0,0 +1,22 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/* The parts of libutils that libvirtqueue uses, for building the host benchmark without util_libs */
+
+#pragma once
+
+#include <stdio.h>
+#include <utils/fence.h>
+
+#define ZF_LOGE(fmt, ...) fprintf(stderr, "virtqueue: " fmt "\n", ##__VA_ARGS__)
+
+#define UNUSED __attribute__((unused))
+
+#define BIT(n) (1ul << (n))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define IS_POWER_OF_2(x) (((x) & ((x) - 1)) == 0)
+#define ROUND_UP(n, b) ((((n) + (b) - 1) / (b)) * (b))
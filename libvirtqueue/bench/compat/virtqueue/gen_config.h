@@ -0,0 +1,10 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/* Stands in for the header generated from the LibVirtqueueStats option. The benchmark defines
+ * CONFIG_LIB_VIRTQUEUE_STATS on the command line instead, see VQ_BENCH_STATS. */
+
+#pragma once
@@ -0,0 +1,720 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/* Latency and throughput benchmark for libvirtqueue, for a Linux host.
+ *
+ * A driver and a device thread, each pinned to a chosen core, share a
+ * virtqueue and its buffer pool in an mmap'd region laid out by
+ * virtqueue_layout. Notifications are eventfds. The driver makes buffer lists
+ * available, each a chain of segments taken from the pool, and the device
+ * reads every byte of them and returns them. For every combination of the
+ * chosen parameters, one line of CSV is written to stdout.
+ *
+ * pingpong keeps a single list in flight, so its percentiles are round-trip
+ * latencies. stream keeps the ring as full as it will go and adds lists in
+ * bursts, so its rates are one-way throughput and its percentiles include
+ * queueing.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <virtqueue.h>
+#include <virtqueue_pool.h>
+
+#define DEFAULT_COUNT       100000
+#define DEFAULT_SEG_SIZE    64
+#define MAX_CHAIN           64
+#define MAX_BURST           256
+#define MAX_PARAMS          16
+#define DEFAULT_SPIN        2048
+
+typedef enum {
+    MODE_PINGPONG,      /* One list in flight */
+    MODE_STREAM,        /* As many lists in flight as fit */
+    NUM_MODES
+} bench_mode_t;
+
+typedef enum {
+    RING_SPLIT,         /* Split ring */
+    RING_IN_ORDER,      /* Split ring with VQ_F_IN_ORDER */
+    RING_IN_RANGE,      /* As RING_IN_ORDER, reclaiming each used batch with one counter advance */
+    RING_PACKED,        /* Packed ring */
+    NUM_RINGS
+} bench_ring_t;
+
+typedef enum {
+    NOTIFY_POLL,        /* Never notify, the waiting side spins */
+    NOTIFY_ALWAYS,      /* Notify after every batch, the waiting side sleeps */
+    NOTIFY_SUPPRESS,    /* Notify when should_notify says so, using the ring flags */
+    NOTIFY_EVENT_IDX,   /* Notify when should_notify says so, with VQ_F_EVENT_IDX */
+    NOTIFY_ADAPTIVE,    /* As NOTIFY_EVENT_IDX, waiting with virtqueue_*_wait */
+    NUM_NOTIFY
+} bench_notify_t;
+
+static const char *mode_names[NUM_MODES] = { "pingpong", "stream" };
+static const char *ring_names[NUM_RINGS] = { "split", "inorder", "inrange", "packed" };
+static const char *notify_names[NUM_NOTIFY] = { "poll", "always", "suppress", "eventidx", "adaptive" };
+
+static const unsigned default_queue_lens[] = { 64, 256 };
+static const unsigned default_bursts[] = { 1, 8, 32 };
+static const unsigned default_chains[] = { 1, 4 };
+
+/* Per-side counters, each written only by its own thread */
+typedef struct side_counts {
+    uint64_t kicks;     /* Notifications sent */
+    uint64_t sleeps;    /* Times blocked waiting for a notification */
+    uint64_t errors;    /* Lists that came back out of order or with the wrong length */
+} side_counts_t;
+
+typedef struct bench {
+    bench_mode_t mode;
+    bench_ring_t ring;
+    bench_notify_t notify;
+    unsigned queue_len;
+    unsigned burst;         /* Most lists added or taken at once */
+    unsigned chain;         /* Segments per list */
+    size_t seg_size;
+    size_t count;           /* Number of lists to send */
+    int drv_cpu;
+    int dev_cpu;
+    int yield;              /* Yield rather than spin when polling */
+    unsigned spin;          /* Most polls before blocking with NOTIFY_ADAPTIVE */
+
+    unsigned char *region;  /* Shared region holding the virtqueue and pool */
+    vq_layout_t layout;
+    size_t pool_size;
+    vq_pool_t pool;
+    void **slots;           /* Segment kept by each descriptor with RING_IN_RANGE */
+    int drv_efd;            /* Notifies the driver of used buffers */
+    int dev_efd;            /* Notifies the device of available buffers */
+
+    virtqueue_driver_t drv;
+    virtqueue_device_t dev;
+    side_counts_t drv_counts;
+    side_counts_t dev_counts;
+    vq_poller_t drv_poller;
+    vq_poller_t dev_poller;
+    uint64_t *sent;         /* Time each list was made available */
+    uint64_t *completed;    /* Time each list was returned to the driver */
+    pthread_barrier_t start;
+} bench_t;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void relax(bench_t *b)
+{
+    if (b->yield) {
+        sched_yield();
+    } else {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+        asm volatile("yield");
+#endif
+    }
+}
+
+static void pin(int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0) {
+        return;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        fprintf(stderr, "warning: failed to pin to cpu %d: %s\n", cpu, strerror(err));
+    }
+}
+
+static void kick(int efd, side_counts_t *counts)
+{
+    uint64_t one = 1;
+
+    if (write(efd, &one, sizeof(one)) != sizeof(one)) {
+        perror("eventfd write");
+        exit(1);
+    }
+    counts->kicks++;
+}
+
+static void sleep_on(int efd, side_counts_t *counts)
+{
+    uint64_t val;
+
+    if (read(efd, &val, sizeof(val)) != sizeof(val)) {
+        perror("eventfd read");
+        exit(1);
+    }
+    counts->sleeps++;
+}
+
+static void driver_sleep(void *cookie)
+{
+    bench_t *b = cookie;
+    sleep_on(b->drv_efd, &b->drv_counts);
+}
+
+static void device_sleep(void *cookie)
+{
+    bench_t *b = cookie;
+    sleep_on(b->dev_efd, &b->dev_counts);
+}
+
+/* Wait until the device has returned something */
+static void driver_wait(bench_t *b)
+{
+    virtqueue_driver_t *vq = &b->drv;
+
+    switch (b->notify) {
+    case NOTIFY_POLL:
+        while (!virtqueue_driver_poll(vq)) {
+            relax(b);
+        }
+        break;
+    case NOTIFY_ALWAYS:
+        while (!virtqueue_driver_poll(vq)) {
+            sleep_on(b->drv_efd, &b->drv_counts);
+        }
+        break;
+    case NOTIFY_ADAPTIVE:
+        virtqueue_driver_wait(vq, &b->drv_poller);
+        break;
+    default:
+        while (!virtqueue_driver_poll(vq)) {
+            if (virtqueue_driver_enable_notify(vq)) {
+                break;
+            }
+            sleep_on(b->drv_efd, &b->drv_counts);
+        }
+        virtqueue_driver_disable_notify(vq);
+        break;
+    }
+}
+
+/* Wait until the driver has made something available */
+static void device_wait(bench_t *b)
+{
+    virtqueue_device_t *vq = &b->dev;
+
+    switch (b->notify) {
+    case NOTIFY_POLL:
+        while (!virtqueue_device_poll(vq)) {
+            relax(b);
+        }
+        break;
+    case NOTIFY_ALWAYS:
+        while (!virtqueue_device_poll(vq)) {
+            sleep_on(b->dev_efd, &b->dev_counts);
+        }
+        break;
+    case NOTIFY_ADAPTIVE:
+        virtqueue_device_wait(vq, &b->dev_poller);
+        break;
+    default:
+        while (!virtqueue_device_poll(vq)) {
+            if (virtqueue_device_enable_notify(vq)) {
+                break;
+            }
+            sleep_on(b->dev_efd, &b->dev_counts);
+        }
+        virtqueue_device_disable_notify(vq);
+        break;
+    }
+}
+
+static unsigned features(bench_t *b)
+{
+    unsigned f = 0;
+
+    if (b->notify == NOTIFY_EVENT_IDX || b->notify == NOTIFY_ADAPTIVE) {
+        f |= VQ_F_EVENT_IDX;
+    }
+    if (b->ring == RING_IN_ORDER || b->ring == RING_IN_RANGE) {
+        f |= VQ_F_IN_ORDER;
+    }
+    return f;
+}
+
+/* Take the segments of a list from the pool and fill them in. The first word of each segment
+ * holds the sequence number of the list so the device can check the order. With RING_IN_RANGE
+ * each descriptor keeps the same segment, as nothing is handed back to free. */
+static int fill_list(bench_t *b, vq_buf_t *segs, uint64_t seq)
+{
+    for (unsigned i = 0; i < b->chain; i++) {
+        if (b->slots != NULL) {
+            segs[i].buf = b->slots[(b->drv.desc_alloc + i) & (b->queue_len - 1)];
+        } else {
+            segs[i].buf = vq_pool_alloc(&b->pool);
+        }
+        if (segs[i].buf == NULL) {
+            return -1;
+        }
+        segs[i].len = b->seg_size;
+        segs[i].flag = VQ_READ;
+        memset(segs[i].buf, (int)seq, b->seg_size);
+        memcpy(segs[i].buf, &seq, sizeof(seq));
+    }
+    return 0;
+}
+
+static void *driver(void *arg)
+{
+    bench_t *b = arg;
+    virtqueue_driver_t *vq = &b->drv;
+    vq_vring_desc_t *desc = NULL;
+    virtqueue_ring_object_t robjs[MAX_BURST];
+    uint32_t lens[MAX_BURST];
+    vq_buf_t segs[MAX_CHAIN];
+    size_t window = b->mode == MODE_PINGPONG ? 1 : b->count;
+    size_t sent = 0;
+    size_t completed = 0;
+
+    pin(b->drv_cpu);
+    if (b->ring == RING_PACKED) {
+        desc = calloc(b->queue_len, sizeof(*desc));
+        if (desc == NULL) {
+            fprintf(stderr, "driver: setup failed\n");
+            exit(1);
+        }
+        virtqueue_init_driver_packed(vq, b->queue_len, (void *)(b->region + b->layout.desc),
+                                     (void *)(b->region + b->layout.avail),
+                                     (void *)(b->region + b->layout.used), desc, NULL, NULL, features(b));
+    } else {
+        virtqueue_init_driver_features(vq, b->queue_len, (void *)(b->region + b->layout.avail),
+                                       (void *)(b->region + b->layout.used),
+                                       (void *)(b->region + b->layout.desc), NULL, NULL, features(b));
+    }
+    virtqueue_driver_set_pool(vq, b->region + b->layout.pool, b->pool_size);
+    if (b->ring == RING_IN_RANGE) {
+        b->slots = calloc(b->queue_len, sizeof(*b->slots));
+        if (b->slots == NULL) {
+            fprintf(stderr, "driver: setup failed\n");
+            exit(1);
+        }
+        for (unsigned i = 0; i < b->queue_len; i++) {
+            b->slots[i] = vq_pool_alloc(&b->pool);
+        }
+    } else {
+        virtqueue_driver_set_buf_pool(vq, &b->pool);
+    }
+    if (b->notify >= NOTIFY_SUPPRESS) {
+        virtqueue_driver_disable_notify(vq);
+    }
+    vq_poller_init(&b->drv_poller, 0, b->spin, driver_sleep, b);
+    virtqueue_stats_set_clock(virtqueue_driver_stats(vq), now_ns, 0);
+    /* The device attaches to the rings we just initialised */
+    pthread_barrier_wait(&b->start);
+    pthread_barrier_wait(&b->start);
+
+    while (completed < b->count) {
+        unsigned added = 0;
+        unsigned n;
+
+        while (sent < b->count && sent - completed < window && added < b->burst) {
+            if (b->slots != NULL && (uint16_t)(vq->desc_alloc - vq->desc_freed) + b->chain > b->queue_len) {
+                /* The segments of the next descriptors are still with the device */
+                break;
+            }
+            if (fill_list(b, segs, sent) != 0) {
+                fprintf(stderr, "driver: buffer pool exhausted\n");
+                exit(1);
+            }
+            b->sent[sent] = now_ns();
+            if (!virtqueue_add_available_chain(vq, segs, b->chain)) {
+                /* The ring is full */
+                for (unsigned i = 0; b->slots == NULL && i < b->chain; i++) {
+                    vq_pool_free(&b->pool, segs[i].buf);
+                }
+                break;
+            }
+            sent++;
+            added++;
+        }
+        if (added > 0 && (b->notify == NOTIFY_ALWAYS ||
+                          (b->notify >= NOTIFY_SUPPRESS && virtqueue_driver_should_notify(vq)))) {
+            kick(b->dev_efd, &b->drv_counts);
+        }
+
+        if (b->slots != NULL) {
+            n = virtqueue_reclaim_used_in_order(vq, lens);
+            for (unsigned i = 0; i < n; i++) {
+                b->completed[completed++] = now_ns();
+            }
+            if (n == 0 && added == 0) {
+                driver_wait(b);
+            }
+            continue;
+        }
+        n = virtqueue_get_used_bufs(vq, robjs, lens, MAX_BURST);
+        for (unsigned i = 0; i < n; i++) {
+            void *buf;
+            unsigned len;
+            vq_flags_t flag;
+
+            /* Gathering the whole list recycles its segments to the pool */
+            while (virtqueue_gather_used(vq, &robjs[i], &buf, &len, &flag));
+            b->completed[completed++] = now_ns();
+        }
+        if (n == 0 && added == 0) {
+            driver_wait(b);
+        }
+    }
+    free(desc);
+    free(b->slots);
+    b->slots = NULL;
+    return NULL;
+}
+
+/* Read a whole list, returning its length, and check that it is the one expected */
+static uint32_t consume(bench_t *b, virtqueue_ring_object_t *robj, uint64_t seq)
+{
+    void *buf;
+    unsigned len;
+    vq_flags_t flag;
+    uint32_t total = 0;
+    unsigned segs = 0;
+    unsigned char sum = 0;
+
+    while (virtqueue_gather_available(&b->dev, robj, &buf, &len, &flag)) {
+        const unsigned char *p = buf;
+        uint64_t got;
+
+        memcpy(&got, p, sizeof(got));
+        if (got != seq) {
+            b->dev_counts.errors++;
+        }
+        for (unsigned i = 0; i < len; i++) {
+            sum += p[i];
+        }
+        total += len;
+        segs++;
+    }
+    if (segs != b->chain) {
+        b->dev_counts.errors++;
+    }
+    /* Keep the reads from being optimised away */
+    __asm__ volatile("" :: "r"(sum));
+    return total;
+}
+
+static void *device(void *arg)
+{
+    bench_t *b = arg;
+    virtqueue_device_t *vq = &b->dev;
+    virtqueue_ring_object_t robjs[MAX_BURST];
+    uint32_t lens[MAX_BURST];
+    unsigned burst = b->mode == MODE_PINGPONG ? 1 : b->burst;
+    size_t done = 0;
+
+    pin(b->dev_cpu);
+    pthread_barrier_wait(&b->start);
+    if (b->ring == RING_PACKED) {
+        virtqueue_init_device_packed(vq, b->queue_len, (void *)(b->region + b->layout.desc),
+                                     (void *)(b->region + b->layout.avail),
+                                     (void *)(b->region + b->layout.used), NULL, NULL, features(b));
+    } else {
+        virtqueue_init_device_features(vq, b->queue_len, (void *)(b->region + b->layout.avail),
+                                       (void *)(b->region + b->layout.used),
+                                       (void *)(b->region + b->layout.desc), NULL, NULL, features(b));
+    }
+    virtqueue_device_set_pool(vq, b->region + b->layout.pool, b->pool_size);
+    if (b->notify >= NOTIFY_SUPPRESS) {
+        virtqueue_device_disable_notify(vq);
+    }
+    vq_poller_init(&b->dev_poller, 0, b->spin, device_sleep, b);
+    virtqueue_stats_set_clock(virtqueue_device_stats(vq), now_ns, 0);
+    pthread_barrier_wait(&b->start);
+
+    while (done < b->count) {
+        unsigned n = virtqueue_get_available_bufs(vq, robjs, burst);
+        if (n == 0) {
+            device_wait(b);
+            continue;
+        }
+        for (unsigned i = 0; i < n; i++) {
+            lens[i] = consume(b, &robjs[i], done + i);
+        }
+        virtqueue_add_used_bufs(vq, robjs, lens, n);
+        done += n;
+        if (b->notify == NOTIFY_ALWAYS ||
+            (b->notify >= NOTIFY_SUPPRESS && virtqueue_device_should_notify(vq))) {
+            kick(b->drv_efd, &b->dev_counts);
+        }
+    }
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, double p)
+{
+    size_t i = (size_t)(p * (double)(n - 1) + 0.5);
+    return sorted[i];
+}
+
+static int run(bench_t *b, int dump_stats)
+{
+    pthread_t drv, dev;
+    size_t seg_size = (b->seg_size + 7) & ~(size_t)7;
+
+    /* Each descriptor in flight holds one segment, plus the list the driver is trying to add.
+     * Segments go back to the pool as soon as the driver has gathered them. */
+    b->pool_size = VQ_CACHE_LINE + (size_t)(b->queue_len + b->chain) * seg_size;
+    if (virtqueue_layout(&b->layout, b->queue_len, b->ring == RING_PACKED ? VQ_F_RING_PACKED : 0,
+                         b->pool_size) != 0) {
+        return -1;
+    }
+    b->region = mmap(NULL, b->layout.size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (b->region == MAP_FAILED) {
+        return -1;
+    }
+    if (vq_pool_init(&b->pool, b->region + b->layout.pool, b->pool_size, b->seg_size) != 0) {
+        return -1;
+    }
+    b->drv_efd = eventfd(0, 0);
+    b->dev_efd = eventfd(0, 0);
+    b->sent = calloc(b->count, sizeof(uint64_t));
+    b->completed = calloc(b->count, sizeof(uint64_t));
+    if (b->drv_efd < 0 || b->dev_efd < 0 || b->sent == NULL || b->completed == NULL) {
+        return -1;
+    }
+
+    pthread_barrier_init(&b->start, NULL, 2);
+    pthread_create(&dev, NULL, device, b);
+    pthread_create(&drv, NULL, driver, b);
+    pthread_join(drv, NULL);
+    pthread_join(dev, NULL);
+    pthread_barrier_destroy(&b->start);
+
+    /* The device returns lists in the order it takes them, so the nth completion is the nth
+     * list sent */
+    double secs = (double)(b->completed[b->count - 1] - b->sent[0]) / 1e9;
+    for (size_t i = 0; i < b->count; i++) {
+        b->completed[i] -= b->sent[i];
+    }
+    qsort(b->completed, b->count, sizeof(uint64_t), compare_u64);
+
+    printf("%s,%s,%s,%u,%u,%u,%zu,%zu,%.6f,%.0f,%.0f,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+           mode_names[b->mode], ring_names[b->ring], notify_names[b->notify], b->queue_len,
+           b->mode == MODE_PINGPONG ? 1 : b->burst, b->chain, b->seg_size, b->count, secs,
+           (double)b->count / secs, (double)(b->count * b->chain * b->seg_size) / secs,
+           (unsigned long long)percentile(b->completed, b->count, 0.5),
+           (unsigned long long)percentile(b->completed, b->count, 0.99),
+           (unsigned long long)percentile(b->completed, b->count, 0.999),
+           (unsigned long long)b->drv_counts.kicks, (unsigned long long)b->dev_counts.kicks,
+           (unsigned long long)b->drv_counts.sleeps, (unsigned long long)b->dev_counts.sleeps,
+           (unsigned long long)b->dev_counts.errors);
+    if (dump_stats) {
+        virtqueue_stats_dump(virtqueue_driver_stats(&b->drv), "driver");
+        virtqueue_stats_dump(virtqueue_device_stats(&b->dev), "device");
+    }
+    fflush(stdout);
+
+    close(b->drv_efd);
+    close(b->dev_efd);
+    free(b->sent);
+    free(b->completed);
+    munmap(b->region, b->layout.size);
+    return b->dev_counts.errors ? -1 : 0;
+}
+
+static int parse_name(const char *arg, const char **names, int count, int *mask)
+{
+    for (int i = 0; i < count; i++) {
+        if (strcmp(arg, names[i]) == 0) {
+            *mask |= 1 << i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int parse_uint(const char *arg, unsigned *vals, size_t *n)
+{
+    if (*n == MAX_PARAMS) {
+        return -1;
+    }
+    vals[(*n)++] = strtoul(arg, NULL, 0);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-m mode] [-R ring] [-N notify] [-q len] [-b burst] [-l chain] [-s size]\n"
+            "          [-n count] [-P spin] [-p cpu] [-c cpu] [-y] [-S]\n"
+            "  -m mode    pingpong or stream; may be repeated (default: both)\n"
+            "  -R ring    split, inorder, inrange or packed; may be repeated (default: split)\n"
+            "  -N notify  poll, always, suppress, eventidx or adaptive; may be repeated (default: all)\n"
+            "  -q len     queue length, a power of 2; may be repeated (default: 64, 256)\n"
+            "  -b burst   lists added and taken at once in stream mode, at most %d; may be repeated\n"
+            "             (default: 1, 8, 32)\n"
+            "  -l chain   segments per list, at most %d; may be repeated (default: 1, 4)\n"
+            "  -s size    segment size in bytes, at least 8 (default: %d)\n"
+            "  -n count   lists per run (default: %d)\n"
+            "  -P spin    most polls before blocking with adaptive (default: %d)\n"
+            "  -p cpu     core to pin the driver to (default: 0, -1 for none)\n"
+            "  -c cpu     core to pin the device to (default: 1, -1 for none)\n"
+            "  -y         yield instead of spinning while polling\n"
+            "  -S         print the virtqueue statistics after each run (needs VQ_BENCH_STATS)\n",
+            prog, MAX_BURST, MAX_CHAIN, DEFAULT_SEG_SIZE, DEFAULT_COUNT, DEFAULT_SPIN);
+}
+
+#define SET_DEFAULT(vals, n, defaults) do { \
+    if ((n) == 0) { \
+        (n) = sizeof(defaults) / sizeof((defaults)[0]); \
+        memcpy((vals), (defaults), sizeof(defaults)); \
+    } \
+} while (0)
+
+int main(int argc, char **argv)
+{
+    int modes = 0;
+    int rings = 0;
+    int notifies = 0;
+    unsigned queue_lens[MAX_PARAMS], bursts[MAX_PARAMS], chains[MAX_PARAMS];
+    size_t nqueue_lens = 0, nbursts = 0, nchains = 0;
+    size_t seg_size = DEFAULT_SEG_SIZE;
+    size_t count = DEFAULT_COUNT;
+    int drv_cpu = 0;
+    int dev_cpu = 1;
+    int yield = 0;
+    unsigned spin = DEFAULT_SPIN;
+    int dump_stats = 0;
+    int opt;
+    int err = 0;
+
+    while ((opt = getopt(argc, argv, "m:R:N:q:b:l:s:n:P:p:c:ySh")) != -1) {
+        switch (opt) {
+        case 'm':
+            err = parse_name(optarg, mode_names, NUM_MODES, &modes);
+            break;
+        case 'R':
+            err = parse_name(optarg, ring_names, NUM_RINGS, &rings);
+            break;
+        case 'N':
+            err = parse_name(optarg, notify_names, NUM_NOTIFY, &notifies);
+            break;
+        case 'q':
+            err = parse_uint(optarg, queue_lens, &nqueue_lens);
+            break;
+        case 'b':
+            err = parse_uint(optarg, bursts, &nbursts);
+            break;
+        case 'l':
+            err = parse_uint(optarg, chains, &nchains);
+            break;
+        case 's':
+            seg_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            count = strtoul(optarg, NULL, 0);
+            break;
+        case 'P':
+            spin = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            drv_cpu = atoi(optarg);
+            break;
+        case 'c':
+            dev_cpu = atoi(optarg);
+            break;
+        case 'y':
+            yield = 1;
+            break;
+        case 'S':
+            dump_stats = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+        if (err) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (seg_size < sizeof(uint64_t) || count == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    modes = modes ? modes : (1 << NUM_MODES) - 1;
+    rings = rings ? rings : 1 << RING_SPLIT;
+    notifies = notifies ? notifies : (1 << NUM_NOTIFY) - 1;
+    SET_DEFAULT(queue_lens, nqueue_lens, default_queue_lens);
+    SET_DEFAULT(bursts, nbursts, default_bursts);
+    SET_DEFAULT(chains, nchains, default_chains);
+
+    printf("mode,ring,notify,queue_len,burst,chain,seg_size,lists,seconds,lists_per_sec,bytes_per_sec,"
+           "p50_ns,p99_ns,p999_ns,drv_kicks,dev_kicks,drv_sleeps,dev_sleeps,errors\n");
+    for (int m = 0; m < NUM_MODES; m++) {
+        for (int r = 0; r < NUM_RINGS; r++) {
+            for (int nt = 0; nt < NUM_NOTIFY; nt++) {
+                if (!(modes & (1 << m)) || !(rings & (1 << r)) || !(notifies & (1 << nt))) {
+                    continue;
+                }
+                for (size_t q = 0; q < nqueue_lens; q++) {
+                    /* The burst makes no difference to a single list in flight */
+                    for (size_t bi = 0; bi < (m == MODE_PINGPONG ? 1 : nbursts); bi++) {
+                        for (size_t c = 0; c < nchains; c++) {
+                            bench_t b = {
+                                .mode = m,
+                                .ring = r,
+                                .notify = nt,
+                                .queue_len = queue_lens[q],
+                                .burst = bursts[bi],
+                                .chain = chains[c],
+                                .seg_size = seg_size,
+                                .count = count,
+                                .drv_cpu = drv_cpu,
+                                .dev_cpu = dev_cpu,
+                                .yield = yield,
+                                .spin = spin,
+                            };
+
+                            if (b.chain == 0 || b.chain > MAX_CHAIN || b.chain > b.queue_len ||
+                                b.burst == 0 || b.burst > MAX_BURST) {
+                                fprintf(stderr, "skipping queue length %u, burst %u, chain %u\n",
+                                        b.queue_len, b.burst, b.chain);
+                                continue;
+                            }
+                            if (run(&b, dump_stats) != 0) {
+                                fprintf(stderr, "%s %s %s run failed\n", mode_names[m], ring_names[r],
+                                        notify_names[nt]);
+                                return 1;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -6,11 +6,27 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
+#include <virtqueue/gen_config.h>
 
 
-#define VQ_DEV_POLL(vq) ((((vq)->a_ring_last_seen + 1) & ((vq)->queue_len - 1)) != (vq)->avail_ring->idx)
-#define VQ_DRV_POLL(vq) ((((vq)->u_ring_last_seen + 1) & ((vq)->queue_len - 1)) != (vq)->used_ring->idx)
+#define VQ_DEV_POLL(vq) virtqueue_device_poll(vq)
+#define VQ_DRV_POLL(vq) virtqueue_driver_poll(vq)
+
+/* Optional features of a virtqueue. Both sides must be initialised with the same set. */
+#define VQ_F_EVENT_IDX  (1u << 0)   /* Suppress notifications using the used_event/avail_event indices */
+#define VQ_F_RING_PACKED (1u << 1)  /* Packed ring format, set by the virtqueue_init_*_packed functions */
+#define VQ_F_IN_ORDER   (1u << 2)   /* The device uses buffers in the order they were made available (split ring only) */
+#define VQ_F_CHAIN_INFO (1u << 3)   /* Make virtqueue_layout reserve a vq_chain_info_t table */
+
+/* Set by the driver in the available ring flags when it does not want to be notified of used buffers */
+#define VQ_AVAIL_F_NO_INTERRUPT 1
+/* Set by the device in the used ring flags when it does not want to be notified of available buffers */
+#define VQ_USED_F_NO_NOTIFY     1
+
+/* Alignment of the parts of a virtqueue placed by virtqueue_layout */
+#define VQ_CACHE_LINE 64
 
 /* Flags for the buffers in the descriptor table */
 typedef enum vq_flags {
@@ -19,7 +35,16 @@ typedef enum vq_flags {
     VQ_RW
 } vq_flags_t;
 
-/* Ring of available buffers */
+/* Set in the flags of a descriptor table entry that points to an indirect table of descriptors
+ * rather than to a buffer. The entries of an indirect table are chained through their next field,
+ * which holds the table length at the end of the chain. */
+#define VQ_DESC_F_INDIRECT 0x4
+
+/* The idx fields of the split rings are free-running: they count the entries ever added and wrap
+ * at 2^16, and the slot of an index in the ring is the index modulo queue_len. */
+
+/* Ring of available buffers. With VQ_F_EVENT_IDX the ring is followed by a uint16_t used_event
+ * (ring[queue_len]) that holds the used ring index at which the driver next wants to be notified. */
 typedef struct vq_vring_avail {
     uint16_t flags;             /* Interrupt suppression flag */
     uint16_t idx;               /* Index of the next free entry in the ring */
@@ -32,7 +57,9 @@ typedef struct vq_vring_used_elem {
     uint32_t len;       /* Length of data that was written by the device */
 } vq_vring_used_elem_t;
 
-/* Ring of used buffers */
+/* Ring of used buffers. With VQ_F_EVENT_IDX the ring is followed by a uint16_t avail_event
+ * (at &ring[queue_len]) that holds the available ring index at which the device next wants to be
+ * notified. */
 typedef struct vq_vring_used {
     uint16_t flags;                             /* Interrupt suppression flag */
     uint16_t idx;                               /* Index of the next free entry in the ring */
@@ -47,23 +74,142 @@ typedef struct vq_vring_desc {
     uint16_t next;      /* Index of the next descriptor table entry in the scatter list */
 } vq_vring_desc_t;
 
+/* Flags of an entry in a packed descriptor ring. The flag of the buffer is stored above
+ * VQ_PACKED_DESC_F_AVAIL. */
+#define VQ_PACKED_DESC_F_NEXT   (1u << 0)   /* The chain continues in the next ring entry */
+#define VQ_PACKED_DESC_F_AVAIL  (1u << 7)
+#define VQ_PACKED_DESC_F_USED   (1u << 15)
+
+/* Entry in a packed descriptor ring, written by the driver to make a buffer available and
+ * overwritten by the device to return a chain of buffers */
+typedef struct vq_packed_desc {
+    uint64_t addr;      /* Address of the buffer in the shared memory */
+    uint32_t len;       /* Length of the buffer, or the length used by the device */
+    uint16_t id;        /* Id of the chain the buffer belongs to */
+    uint16_t flags;     /* VQ_PACKED_DESC_F_* flags and the flag of the buffer */
+} vq_packed_desc_t;
+
+/* Values of the flags of a packed ring event suppression area */
+#define VQ_PACKED_EVENT_F_ENABLE    0   /* Notify on every update */
+#define VQ_PACKED_EVENT_F_DISABLE   1   /* Don't notify */
+#define VQ_PACKED_EVENT_F_DESC      2   /* Notify when the ring entry in off_wrap is reached */
+
+/* Event suppression area of a packed ring. The driver area controls used buffer notifications,
+ * the device area controls available buffer notifications. */
+typedef struct vq_packed_event {
+    uint16_t off_wrap;  /* Ring entry (bits 0-14) and wrap counter (bit 15) at which to notify */
+    uint16_t flags;     /* VQ_PACKED_EVENT_F_* */
+} vq_packed_event_t;
+
+/* Placement of the shared parts of a virtqueue within one region, as offsets from its start.
+ * Each part starts on its own cache line. */
+typedef struct vq_layout {
+    size_t desc;    /* The descriptor table, or the descriptor ring of a packed virtqueue */
+    size_t avail;   /* The available ring, or the driver event suppression area */
+    size_t used;    /* The used ring, or the device event suppression area */
+    size_t chain;   /* The chain information table, or 0 without VQ_F_CHAIN_INFO */
+    size_t pool;    /* The buffer pool */
+    size_t size;    /* The size of the region, a multiple of VQ_CACHE_LINE */
+} vq_layout_t;
+
+/* Summary of a buffer list, written by the driver before it makes the list available. The table
+ * holds one entry per descriptor table entry (split ring) or buffer id (packed ring), for the
+ * list that starts there. */
+typedef struct vq_chain_info {
+    uint32_t len;       /* Total length of the buffers in the list */
+    uint32_t count;     /* Number of buffers in the list, counting each entry of an indirect table */
+} vq_chain_info_t;
+
+/* A buffer passed to or returned from the batched functions */
+typedef struct vq_buf {
+    void *buf;          /* Address of the buffer */
+    unsigned len;       /* Length of the buffer */
+    vq_flags_t flag;    /* Flag of the buffer */
+} vq_buf_t;
+
+/* State of a consumer waiting for the other side with virtqueue_driver_wait or
+ * virtqueue_device_wait. The ring is polled up to spin times before notifications are turned on
+ * and the consumer blocks in wait. The spin budget follows the arrival rate: it doubles, up to
+ * spin_max, when buffers turn up late in the budget or just after it runs out, and halves, down
+ * to spin_min, when the consumer has to block. A budget of 0 grows back to 1 when buffers are
+ * found as notifications are turned on. */
+typedef struct vq_poller {
+    void (*wait)(void *cookie); /* Block until notified by the other side, e.g. seL4_Wait */
+    void *cookie;               /* Passed to wait */
+    unsigned spin_min;          /* Least number of polls before blocking */
+    unsigned spin_max;          /* Most number of polls before blocking */
+    unsigned spin;              /* Current number of polls before blocking */
+} vq_poller_t;
+
 /* Handle for iterating through a scatter list */
 typedef struct virtqueue_ring_object {
     uint32_t cur;       /* The current index in desc table */
     uint32_t first;     /* The head of the scatter list in desc table */
+    struct vq_vring_desc *indirect; /* The indirect table being iterated, or NULL */
+    uint32_t indirect_cur;          /* The current index in the indirect table */
+    uint32_t indirect_len;          /* The number of entries in the indirect table */
+    uint16_t id;        /* The id of the chain (packed ring device side only) */
+    uint16_t count;     /* The number of ring entries taken by the chain (packed ring device side only) */
+    void *recycle;      /* Buffer to give back to the pool on the next gather (driver side only) */
 } virtqueue_ring_object_t;
 
+/* Number of buckets in the histograms of vq_stats_t. Bucket b counts values in [2^b, 2^(b+1)),
+ * with 0 counted in bucket 0 and anything larger than the range in the last bucket. */
+#define VQ_STATS_BATCH_BUCKETS 16
+#define VQ_STATS_LATENCY_BUCKETS 32
+
+/* Default number of buffer lists between latency samples */
+#define VQ_STATS_SAMPLE_PERIOD 64
+
+/* Statistics kept by a virtqueue when built with CONFIG_LIB_VIRTQUEUE_STATS. Adds count on the
+ * side that adds to a ring (available for the driver, used for the device), gets on the side that
+ * takes from it. The latency is sampled from an add to the matching get on the driver side
+ * (enqueue to completion) and from a get to the matching add on the device side (service time). */
+typedef struct vq_stats {
+    uint64_t enqueued;          /* Buffer lists added to the ring */
+    uint64_t dequeued;          /* Buffer lists taken from the ring */
+    uint64_t full;              /* Adds that were cut short because the ring was full */
+    uint64_t empty_polls;       /* Gets that found nothing */
+    uint64_t notify_sent;       /* Calls to should_notify that asked for a notification */
+    uint64_t notify_suppressed; /* Calls to should_notify that didn't */
+    uint64_t batch_hist[VQ_STATS_BATCH_BUCKETS];        /* Buffer lists taken per successful get */
+    uint64_t latency_hist[VQ_STATS_LATENCY_BUCKETS];    /* Sampled latencies in clock ticks */
+
+    uint64_t (*clock)(void);    /* Time source for latency sampling, or NULL for none */
+    uint32_t sample_period;     /* Buffer lists between latency samples */
+    uint32_t sample_wait;       /* Buffer lists left until the next sample */
+    uint32_t sample_id;         /* Head of the buffer list being timed, or (uint32_t)-1 */
+    uint64_t sample_start;      /* Clock when the buffer list being timed was added */
+} vq_stats_t;
+
 /* A device-side virtqueue */
 typedef struct virtqueue_device {
     void (*notify)(void);       /* Notify function to wake-up driver side */
     void *cookie;               /* User-defined cookie */
 
     unsigned queue_len;         /* The number of entries in rings and descriptor table */
-    unsigned a_ring_last_seen;  /* Index of the last seen element in the available ring */
+    uint16_t a_ring_last_seen;  /* Free-running index of the last seen element in the available ring */
+    unsigned features;          /* VQ_F_* features in use */
+    unsigned u_ring_notified;   /* Used ring index when the driver was last notified */
 
     struct vq_vring_avail *avail_ring; /* The available ring */
     struct vq_vring_used *used_ring;   /* The used ring */
     struct vq_vring_desc *desc_table;  /* The descriptor table */
+
+    struct vq_packed_desc *packed_ring;     /* The descriptor ring (packed ring only) */
+    struct vq_packed_event *driver_event;   /* The driver event suppression area (packed ring only) */
+    struct vq_packed_event *device_event;   /* The device event suppression area (packed ring only) */
+    uint16_t p_avail;   /* Free-running count of ring entries taken from the driver (packed ring only) */
+    uint16_t p_used;    /* Free-running count of ring entries returned to the driver (packed ring only) */
+    uint16_t p_done;    /* Free-running count of ring entries the device has finished reading (packed ring only) */
+
+    void *pool;                 /* Base of the buffer pool if descriptors hold offsets, or NULL */
+    size_t pool_size;           /* Size of the buffer pool */
+    struct vq_chain_info *chain_info;   /* Chain information left by the driver, or NULL */
+
+#ifdef CONFIG_LIB_VIRTQUEUE_STATS
+    vq_stats_t stats;           /* Statistics of this side of the queue */
+#endif
 } virtqueue_device_t;
 
 /* A driver-side virtqueue */
@@ -73,13 +219,58 @@ typedef struct virtqueue_driver {
 
     unsigned queue_len;         /* The number of entries in rings and descriptor table */
     unsigned free_desc_head;    /* The head of the free list in the descriptor table */
-    unsigned u_ring_last_seen;  /* Index of the last seen element in the used ring */
+    uint16_t u_ring_last_seen;  /* Free-running index of the last seen element in the used ring */
+    unsigned features;          /* VQ_F_* features in use */
+    unsigned a_ring_notified;   /* Available ring index when the device was last notified */
 
     struct vq_vring_avail *avail_ring; /* The available ring */
     struct vq_vring_used *used_ring;   /* The used ring */
     struct vq_vring_desc *desc_table;  /* The descritor table */
+
+    struct vq_packed_desc *packed_ring;     /* The descriptor ring (packed ring only) */
+    struct vq_packed_event *driver_event;   /* The driver event suppression area (packed ring only) */
+    struct vq_packed_event *device_event;   /* The device event suppression area (packed ring only) */
+    uint16_t p_avail;   /* Free-running count of ring entries made available (packed ring only) */
+    uint16_t p_used;    /* Free-running count of ring entries returned by the device (packed ring only) */
+
+    void *pool;                 /* Base of the buffer pool if descriptors hold offsets, or NULL */
+    size_t pool_size;           /* Size of the buffer pool */
+    struct vq_pool *buf_pool;   /* Pool that used buffers are recycled to, or NULL */
+    struct vq_chain_info *chain_info;   /* Chain information to fill in for the device, or NULL */
+
+    uint16_t desc_alloc;        /* Free-running count of descriptors allocated (in-order only) */
+    uint16_t desc_freed;        /* Free-running count of descriptors freed (in-order only) */
+    uint16_t a_ring_completed;  /* Free-running count of available entries completed (in-order only) */
+    uint32_t in_order_id;       /* Head of the last list of the used batch being returned, or queue_len */
+    uint32_t in_order_len;      /* Used length of that list */
+
+#ifdef CONFIG_LIB_VIRTQUEUE_STATS
+    vq_stats_t stats;           /* Statistics of this side of the queue */
+#endif
 } virtqueue_driver_t;
 
+/* Translate a buffer into the address stored in a descriptor by the driver */
+static inline uint64_t virtqueue_driver_buf_addr(virtqueue_driver_t *vq, void *buf)
+{
+    return (uintptr_t)buf - (uintptr_t)vq->pool;
+}
+
+/* Translate the address stored in a descriptor back into a buffer on the driver side */
+static inline void *virtqueue_driver_buf_ptr(virtqueue_driver_t *vq, uint64_t addr)
+{
+    return (void *)((uintptr_t)vq->pool + (uintptr_t)addr);
+}
+
+/* Translate the address stored in a descriptor into a buffer on the device side. Returns NULL if
+ * the device has a pool and the buffer doesn't lie entirely within it. */
+static inline void *virtqueue_device_buf_ptr(virtqueue_device_t *vq, uint64_t addr, uint32_t len)
+{
+    if (vq->pool_size != 0 && (addr > vq->pool_size || len > vq->pool_size - addr)) {
+        return NULL;
+    }
+    return (void *)((uintptr_t)vq->pool + (uintptr_t)addr);
+}
+
 /* Initialise a driver-side virtqueue.
  * @param vq the driver virtqueue
  * @param queue_len the length of rings and descriptor table
@@ -93,6 +284,20 @@ void virtqueue_init_driver(virtqueue_driver_t *vq, unsigned queue_len, vq_vring_
                            vq_vring_used_t *used_ring, vq_vring_desc_t *desc, void (*notify)(void),
                            void *cookie);
 
+/* Initialise a driver-side virtqueue with optional features.
+ * @param vq the driver virtqueue
+ * @param queue_len the length of rings and descriptor table
+ * @param avail_ring pointer to the shared available ring
+ * @param used_ring pointer to the shared used ring
+ * @param desc pointer to the shared descriptor table
+ * @param notify the notify function to wake up device side
+ * @param cookie user's cookie
+ * @param features the VQ_F_* features to use
+ */
+void virtqueue_init_driver_features(virtqueue_driver_t *vq, unsigned queue_len, vq_vring_avail_t *avail_ring,
+                                    vq_vring_used_t *used_ring, vq_vring_desc_t *desc, void (*notify)(void),
+                                    void *cookie, unsigned features);
+
 /* Initialise a device-side virtqueue.
  * @param vq the device virtqueue
  * @param queue_len the length of rings and descriptor table
@@ -106,6 +311,143 @@ void virtqueue_init_device(virtqueue_device_t *vq, unsigned queue_len, vq_vring_
                            vq_vring_used_t *used_ring, vq_vring_desc_t *desc, void (*notify)(void),
                            void *cookie);
 
+/* Initialise a device-side virtqueue with optional features.
+ * @param vq the device virtqueue
+ * @param queue_len the length of rings and descriptor table
+ * @param avail_ring pointer to the shared available ring
+ * @param used_ring pointer to the shared used ring
+ * @param desc pointer to the shared descriptor table
+ * @param notify the notify function to wake up driver side
+ * @param cookie user's cookie
+ * @param features the VQ_F_* features to use, which must match the driver's
+ */
+void virtqueue_init_device_features(virtqueue_device_t *vq, unsigned queue_len, vq_vring_avail_t *avail_ring,
+                                    vq_vring_used_t *used_ring, vq_vring_desc_t *desc, void (*notify)(void),
+                                    void *cookie, unsigned features);
+
+/* Initialise a driver-side virtqueue using the packed ring format. The driver keeps track of its
+ * buffers in a descriptor table of its own, which does not need to be shared with the device.
+ * @param vq the driver virtqueue
+ * @param queue_len the number of entries in the ring, a power of 2 no larger than 32768
+ * @param ring pointer to the shared descriptor ring
+ * @param driver_event pointer to the shared driver event suppression area
+ * @param device_event pointer to the shared device event suppression area
+ * @param desc pointer to a private descriptor table of queue_len entries
+ * @param notify the notify function to wake up device side
+ * @param cookie user's cookie
+ * @param features the VQ_F_* features to use
+ */
+void virtqueue_init_driver_packed(virtqueue_driver_t *vq, unsigned queue_len, vq_packed_desc_t *ring,
+                                  vq_packed_event_t *driver_event, vq_packed_event_t *device_event,
+                                  vq_vring_desc_t *desc, void (*notify)(void), void *cookie,
+                                  unsigned features);
+
+/* Initialise a device-side virtqueue using the packed ring format.
+ * @param vq the device virtqueue
+ * @param queue_len the number of entries in the ring
+ * @param ring pointer to the shared descriptor ring
+ * @param driver_event pointer to the shared driver event suppression area
+ * @param device_event pointer to the shared device event suppression area
+ * @param notify the notify function to wake up driver side
+ * @param cookie user's cookie
+ * @param features the VQ_F_* features to use, which must match the driver's
+ */
+void virtqueue_init_device_packed(virtqueue_device_t *vq, unsigned queue_len, vq_packed_desc_t *ring,
+                                  vq_packed_event_t *driver_event, vq_packed_event_t *device_event,
+                                  void (*notify)(void), void *cookie, unsigned features);
+
+/* Compute the placement of the shared parts of a virtqueue and its buffer pool within a single
+ * region. Several virtqueues can be packed into one region by placing them one after the other.
+ * @param layout the layout to fill in
+ * @param queue_len the length of rings and descriptor table
+ * @param features the VQ_F_* features that will be used, which decide the ring format
+ * @param pool_size the size of the buffer pool, which may be 0
+ * @return 0 on success, -1 if queue_len is invalid
+ */
+int virtqueue_layout(vq_layout_t *layout, unsigned queue_len, unsigned features, size_t pool_size);
+
+/* Make the driver store buffer addresses in descriptors as offsets from the start of a pool,
+ * rather than as virtual addresses, so the device can map the pool at a different address. All
+ * buffers, including indirect tables, must then come from the pool. Call after initialisation;
+ * the device must do the same with its own mapping of the pool.
+ * @param vq the driver virtqueue
+ * @param pool the driver's mapping of the pool
+ * @param pool_size the size of the pool
+ */
+void virtqueue_driver_set_pool(virtqueue_driver_t *vq, void *pool, size_t pool_size);
+
+/* Recycle used buffers to a pool. Buffers returned by virtqueue_gather_used that were allocated
+ * from the pool are freed on the next call to virtqueue_gather_used with the same ring object, so
+ * the caller can read each one in place but must iterate through the whole scatter list.
+ * Buffers of a list may lie in the same pool buffer only if they are adjacent in the list, in
+ * which case it is freed once; debug builds assert this.
+ * @param vq the driver virtqueue
+ * @param buf_pool the pool, or NULL to stop recycling
+ */
+void virtqueue_driver_set_buf_pool(virtqueue_driver_t *vq, struct vq_pool *buf_pool);
+
+/* Make the device read buffer addresses in descriptors as offsets from the start of a pool. The
+ * gather functions stop at any buffer that isn't entirely within the pool.
+ * @param vq the device virtqueue
+ * @param pool the device's mapping of the pool
+ * @param pool_size the size of the pool
+ */
+void virtqueue_device_set_pool(virtqueue_device_t *vq, void *pool, size_t pool_size);
+
+/* Make the driver record the total length and number of buffers of each list it makes available,
+ * so the device can size a list without walking its descriptors. Call after initialisation, with
+ * the table at the chain offset of a layout made with VQ_F_CHAIN_INFO. While recording,
+ * virtqueue_add_available_buf won't chain onto a list that is already available, as the device
+ * may have read its summary.
+ * @param vq the driver virtqueue
+ * @param table the table, queue_len entries, or NULL to stop
+ */
+void virtqueue_driver_set_chain_info(virtqueue_driver_t *vq, vq_chain_info_t *table);
+
+/* Make the device use the chain information recorded by the driver. The information is only as
+ * trustworthy as the driver; the buffers themselves are still checked when they are gathered.
+ * @param vq the device virtqueue
+ * @param table the device's mapping of the table, or NULL to stop
+ */
+void virtqueue_device_set_chain_info(virtqueue_device_t *vq, vq_chain_info_t *table);
+
+/* Initialise the state of a consumer wait. The spin budget starts at spin_max.
+ * @param poller the state to initialise
+ * @param spin_min the least number of polls before blocking, 0 to block straight away when idle
+ * @param spin_max the most number of polls before blocking
+ * @param wait a function that blocks until the other side notifies
+ * @param cookie passed to wait
+ */
+void vq_poller_init(vq_poller_t *poller, unsigned spin_min, unsigned spin_max,
+                    void (*wait)(void *cookie), void *cookie);
+
+/** Statistics **/
+
+/* Get the statistics of a virtqueue
+ * @param vq the driver or device virtqueue
+ * @return the statistics, or NULL if the library was built without CONFIG_LIB_VIRTQUEUE_STATS
+ */
+vq_stats_t *virtqueue_driver_stats(virtqueue_driver_t *vq);
+vq_stats_t *virtqueue_device_stats(virtqueue_device_t *vq);
+
+/* Start sampling latencies. Sampling is off after initialisation.
+ * @param stats the statistics, which may be NULL
+ * @param clock a monotonic time source, e.g. a cycle counter, or NULL to stop sampling
+ * @param period the number of buffer lists between samples, 0 for VQ_STATS_SAMPLE_PERIOD
+ */
+void virtqueue_stats_set_clock(vq_stats_t *stats, uint64_t (*clock)(void), unsigned period);
+
+/* Zero all of the counters and histograms, keeping the clock
+ * @param stats the statistics, which may be NULL
+ */
+void virtqueue_stats_reset(vq_stats_t *stats);
+
+/* Print the statistics
+ * @param stats the statistics, which may be NULL
+ * @param name a name to identify the queue in the output
+ */
+void virtqueue_stats_dump(vq_stats_t *stats, const char *name);
+
 /* Initialise the descriptor table (create the free list) */
 void virtqueue_init_desc_table(vq_vring_desc_t *table, unsigned queue_len);
 
@@ -126,10 +468,39 @@ void virtqueue_init_used_ring(vq_vring_used_t *ring);
  * @param len the length of the buffer
  * @param flag the flag of the buffer
  * @return 1 on success, 0 on failure (ring full)
+ *
+ * The entry is visible to the device as soon as it is created, so a device running concurrently
+ * may see the scatter list before later buffers are chained onto it, and with the packed ring
+ * format buffers can't be chained at all, nor while chain information is recorded. Use
+ * virtqueue_add_available_chain to add a complete list instead.
  */
 int virtqueue_add_available_buf(virtqueue_driver_t *vq, virtqueue_ring_object_t *obj,
                                 void *buf, unsigned len, vq_flags_t flag);
 
+/* Add a scatter list of buffers to the available ring as a single entry. The device sees either
+ * none or all of the list.
+ * @param vq the driver virtqueue
+ * @param bufs the buffers to add
+ * @param n the number of buffers, at least 1
+ * @return 1 on success, 0 on failure (ring full)
+ */
+int virtqueue_add_available_chain(virtqueue_driver_t *vq, const vq_buf_t *bufs, unsigned n);
+
+/* Add a scatter list of buffers through an indirect descriptor table, so that it only takes up
+ * a single entry in the descriptor table however many buffers it has. Like
+ * virtqueue_add_available_buf, the first call with a freshly initialised handle creates a new
+ * entry in the available ring and later calls chain onto it.
+ * @param vq the driver virtqueue
+ * @param obj the handle to the ring object
+ * @param table an array of n descriptors in memory shared with the device, to be filled in. It
+ *              must not be reused until the scatter list has been gathered from the used ring.
+ * @param bufs the buffers to add
+ * @param n the number of buffers to add
+ * @return 1 on success, 0 on failure (ring full, or the packed ring format)
+ */
+int virtqueue_add_available_indirect(virtqueue_driver_t *vq, virtqueue_ring_object_t *obj,
+                                     vq_vring_desc_t *table, const vq_buf_t *bufs, unsigned n);
+
 /* Get buffer from used ring. Dequeue a buffer from the used ring and get an iterator to the scatterlist
  * @param vq the driver side virtqueue
  * @param robj a pointer to the iterator that will be returned
@@ -138,14 +509,96 @@ int virtqueue_add_available_buf(virtqueue_driver_t *vq, virtqueue_ring_object_t
  */
 int virtqueue_get_used_buf(virtqueue_driver_t *vq, virtqueue_ring_object_t *robj, uint32_t *len);
 
+/* Add a batch of buffers to the available ring, each as a single-buffer scatter list. All
+ * the ring entries are written first and then published to the device with a single update
+ * of the ring index.
+ * @param vq the driver virtqueue
+ * @param bufs the buffers to add
+ * @param n the number of buffers to add
+ * @return the number of buffers added, from the start of bufs, which is less than n if the
+ *         ring fills up
+ */
+unsigned virtqueue_add_available_bufs(virtqueue_driver_t *vq, const vq_buf_t *bufs, unsigned n);
+
+/* Get a batch of buffers from the used ring. Equivalent to calling virtqueue_get_used_buf up to
+ * n times, but reads the ring index only once.
+ * @param vq the driver side virtqueue
+ * @param robjs an array of iterators to fill in
+ * @param lens an array to fill in with the lengths of the buffers that were actually used
+ * @param n the maximum number of buffers to get
+ * @return the number of buffers dequeued
+ */
+unsigned virtqueue_get_used_bufs(virtqueue_driver_t *vq, virtqueue_ring_object_t *robjs, uint32_t *lens,
+                                 unsigned n);
+
+/* Take the next used entry of an in-order split ring and give back the descriptors of every
+ * buffer list it completes with a single counter update, without walking them. The lists are
+ * not returned, so nothing is recycled to the buffer pool; use this when the caller tracks its
+ * buffers by descriptor position itself. Lists already returned by virtqueue_get_used_bufs must
+ * be gathered first, as their descriptors are given back too.
+ * @param vq the driver side virtqueue, initialised with VQ_F_IN_ORDER
+ * @param len filled in with the used length of the last list completed
+ * @return the number of buffer lists completed, 0 if there is no used entry
+ */
+unsigned virtqueue_reclaim_used_in_order(virtqueue_driver_t *vq, uint32_t *len);
+
+/* Check whether there are buffers in the used ring
+ * @param vq the driver side virtqueue
+ * @return 1 if virtqueue_get_used_buf would succeed, 0 otherwise
+ */
+int virtqueue_driver_poll(virtqueue_driver_t *vq);
+
+/* Check whether the device needs to be notified of the buffers made available since the last
+ * call to this function, whatever it returned. Call after adding buffers and call vq->notify()
+ * only if this returns 1.
+ * @param vq the driver side virtqueue
+ * @return 1 if the device should be notified, 0 otherwise
+ */
+int virtqueue_driver_should_notify(virtqueue_driver_t *vq);
+
+/* Ask the device to notify the driver when buffers are added to the used ring. The device may
+ * have added buffers before seeing the request, so the caller must check the used ring again
+ * before waiting.
+ * @param vq the driver side virtqueue
+ * @return 1 if there are used buffers pending, 0 otherwise
+ */
+int virtqueue_driver_enable_notify(virtqueue_driver_t *vq);
+
+/* Ask the device not to notify the driver of used buffers, e.g. while the driver is polling.
+ * @param vq the driver side virtqueue
+ */
+void virtqueue_driver_disable_notify(virtqueue_driver_t *vq);
+
+/* Wait until there are buffers in the used ring, first by polling and then by turning on
+ * notifications and blocking. Notifications are off again on return, so the driver can keep
+ * polling while it works through the buffers.
+ * @param vq the driver side virtqueue
+ * @param poller the state of the wait, see vq_poller_t
+ */
+void virtqueue_driver_wait(virtqueue_driver_t *vq, vq_poller_t *poller);
+
 /** Device side **/
 
+/* With VQ_F_IN_ORDER the device must add buffer lists to the used ring in the order it got them
+ * from the available ring, and the driver must gather used lists in the order it gets them and
+ * finish each list before adding another one. Descriptors are then allocated and freed in ring
+ * order by counters rather than through the free list. A batch added with
+ * virtqueue_add_used_bufs takes a single used ring entry, for the last list of the batch, and the
+ * driver gets the earlier lists of the batch with a length of 0. Add lists one at a time if
+ * their used lengths matter.
+ */
+
 /* Add buffer to used ring. Takes an ring object (obtained from a get_available_buf call) and passes it
  * to the used ring.
  * @param vq the device side virtqueue
  * @param robj a pointer to the ring object
  * @param len the length of the buffer that the device actually used
- * @return 1 on success, 0 on failure (ring full)
+ * @return 1 on success, 0 on failure (ring full, or see below)
+ *
+ * With the packed ring format used entries overwrite the ring in place, starting from the oldest
+ * entry taken from it. A list counts as finished with once it has been gathered to the end or
+ * added here, and adding a list fails if its used entry would overwrite one that isn't, e.g.
+ * when lists are completed out of order before the older ones have been gathered.
  */
 int virtqueue_add_used_buf(virtqueue_device_t *vq, virtqueue_ring_object_t *robj, uint32_t len);
 
@@ -156,12 +609,67 @@ int virtqueue_add_used_buf(virtqueue_device_t *vq, virtqueue_ring_object_t *robj
  */
 int virtqueue_get_available_buf(virtqueue_device_t *vq, virtqueue_ring_object_t *robj);
 
+/* Add a batch of ring objects to the used ring. All the ring entries are written first and then
+ * published to the driver with a single update of the ring index.
+ * @param vq the device side virtqueue
+ * @param robjs the ring objects, as obtained from the available ring
+ * @param lens the lengths of the buffers that the device actually used
+ * @param n the number of ring objects
+ * @return the number of ring objects added
+ */
+unsigned virtqueue_add_used_bufs(virtqueue_device_t *vq, virtqueue_ring_object_t *robjs, const uint32_t *lens,
+                                 unsigned n);
+
+/* Get a batch of buffers from the available ring. Equivalent to calling
+ * virtqueue_get_available_buf up to n times, but reads the ring index only once.
+ * @param vq the device side virtqueue
+ * @param robjs an array of iterators to fill in
+ * @param n the maximum number of buffers to get
+ * @return the number of buffers dequeued
+ */
+unsigned virtqueue_get_available_bufs(virtqueue_device_t *vq, virtqueue_ring_object_t *robjs, unsigned n);
+
+/* Check whether there are buffers in the available ring
+ * @param vq the device side virtqueue
+ * @return 1 if virtqueue_get_available_buf would succeed, 0 otherwise
+ */
+int virtqueue_device_poll(virtqueue_device_t *vq);
+
+/* Check whether the driver needs to be notified of the buffers used since the last call to this
+ * function, whatever it returned. Call after adding used buffers and call vq->notify() only if
+ * this returns 1.
+ * @param vq the device side virtqueue
+ * @return 1 if the driver should be notified, 0 otherwise
+ */
+int virtqueue_device_should_notify(virtqueue_device_t *vq);
+
+/* Ask the driver to notify the device when buffers are added to the available ring. The driver
+ * may have added buffers before seeing the request, so the caller must check the available ring
+ * again before waiting.
+ * @param vq the device side virtqueue
+ * @return 1 if there are available buffers pending, 0 otherwise
+ */
+int virtqueue_device_enable_notify(virtqueue_device_t *vq);
+
+/* Ask the driver not to notify the device of available buffers, e.g. while the device is polling.
+ * @param vq the device side virtqueue
+ */
+void virtqueue_device_disable_notify(virtqueue_device_t *vq);
+
+/* Wait until there are buffers in the available ring, first by polling and then by turning on
+ * notifications and blocking. Notifications are off again on return.
+ * @param vq the device side virtqueue
+ * @param poller the state of the wait, see vq_poller_t
+ */
+void virtqueue_device_wait(virtqueue_device_t *vq, vq_poller_t *poller);
+
 /** Iteration functions **/
 
 /* Initialise a ring object */
 void virtqueue_init_ring_object(virtqueue_ring_object_t *obj);
 
-/* Get the size of a scattered list in the available ring from its handle
+/* Get the size of a scattered list in the available ring from its handle. This walks the list
+ * unless the device has chain information, see virtqueue_device_set_chain_info.
  * @param vq the device side virtqueue
  * @param robj a pointer to the ring object/handle
  * @return the length of the scatterlist
@@ -179,7 +687,20 @@ uint32_t virtqueue_scattered_available_size(virtqueue_device_t *vq, virtqueue_ri
 int virtqueue_gather_available(virtqueue_device_t *vq, virtqueue_ring_object_t *robj,
                                void **buf, unsigned *len, vq_flags_t *flag);
 
-/* Iteration function through a used buffer scatterlist. Returns the next buffer in the list.
+/* Gather the buffers of an available scatterlist into an array in one call, reading each
+ * descriptor once. If the list has more than n buffers, the rest can be gathered by calling again.
+ * @param vq the device side virtqueue
+ * @param robj the handle/iterator upon which to iterate
+ * @param bufs an array to fill in with the buffers
+ * @param n the size of the array
+ * @return the number of buffers gathered, 0 when there are no more
+ */
+unsigned virtqueue_gather_available_bufs(virtqueue_device_t *vq, virtqueue_ring_object_t *robj,
+                                         vq_buf_t *bufs, unsigned n);
+
+/* Iteration function through a used buffer scatterlist. Returns the next buffer in the list. If
+ * the driver has a buffer pool, the buffer previously returned for this ring object is given back
+ * to it.
  * @param vq the driver side virtqueue
  * @param robj the handle/iterator upon which to iterate
  * @param buf a pointer to the address of the returned buffer
@@ -0,0 +1,58 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A pool of fixed-size buffers in shared memory, e.g. the pool area of a virtqueue_layout. The
+ * free list is kept in the shared memory itself and is lock-free, so buffers can be allocated and
+ * freed by several threads, or by several components that map the same pool. */
+typedef struct vq_pool {
+    uint64_t *head;     /* Head of the free list: a generation count and the index + 1 of the first free buffer */
+    char *bufs;         /* The first buffer */
+    size_t buf_size;    /* The size of each buffer */
+    uint32_t count;     /* The number of buffers */
+} vq_pool_t;
+
+/* Initialise a pool in a memory region, putting all of its buffers on the free list. The first
+ * cache line of the region holds the free list head and the rest is divided into buffers.
+ * @param pool the pool to initialise
+ * @param mem the memory region, aligned to a cache line
+ * @param size the size of the region
+ * @param buf_size the size of each buffer, which is rounded up to a multiple of 8
+ * @return 0 on success, -1 if the region is too small for a single buffer
+ */
+int vq_pool_init(vq_pool_t *pool, void *mem, size_t size, size_t buf_size);
+
+/* Attach to a pool that was initialised by someone else, possibly through a different mapping.
+ * @param pool the pool to attach
+ * @param mem this side's mapping of the memory region
+ * @param size the size of the region
+ * @param buf_size the size of each buffer, as passed to vq_pool_init
+ * @return 0 on success, -1 if the region is too small for a single buffer
+ */
+int vq_pool_attach(vq_pool_t *pool, void *mem, size_t size, size_t buf_size);
+
+/* Take a buffer from the pool
+ * @param pool the pool
+ * @return a buffer of pool->buf_size bytes, or NULL if the pool is empty
+ */
+void *vq_pool_alloc(vq_pool_t *pool);
+
+/* Give a buffer back to the pool
+ * @param pool the pool
+ * @param buf a buffer obtained from vq_pool_alloc. Any address inside the buffer is accepted.
+ */
+void vq_pool_free(vq_pool_t *pool, void *buf);
+
+/* Check whether an address lies inside one of the buffers of a pool
+ * @param pool the pool
+ * @param buf the address to check
+ * @return 1 if it does, 0 otherwise
+ */
+int vq_pool_contains(vq_pool_t *pool, void *buf);
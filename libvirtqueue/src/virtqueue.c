@@ -4,44 +4,237 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <assert.h>
 #include <utils/util.h>
+#include <utils/fence.h>
 #include <virtqueue.h>
+#include <virtqueue_pool.h>
+
+#include "virtqueue_packed.h"
+#include "virtqueue_stats.h"
+
+/* The ring indices are shared with the other side, which may be running on another core. Entries
+ * are published by a release store of the index and consumed after an acquire load of it. */
+static inline uint16_t vq_load_idx(uint16_t *idx)
+{
+    uint16_t ret = *(volatile uint16_t *)idx;
+    THREAD_MEMORY_ACQUIRE();
+    return ret;
+}
+
+static inline void vq_store_idx(uint16_t *idx, uint16_t val)
+{
+    THREAD_MEMORY_RELEASE();
+    *(volatile uint16_t *)idx = val;
+}
+
+/* The event indices live just past the end of the opposite rings */
+#define VQ_USED_EVENT(vq) ((vq)->avail_ring->ring[(vq)->queue_len])
+#define VQ_AVAIL_EVENT(vq) (*(uint16_t *)(void *)((vq)->used_ring->ring + (vq)->queue_len))
 
 void virtqueue_init_driver(virtqueue_driver_t *vq, unsigned queue_len, vq_vring_avail_t *avail_ring,
                            vq_vring_used_t *used_ring, vq_vring_desc_t *desc, void (*notify)(void),
                            void *cookie)
+{
+    virtqueue_init_driver_features(vq, queue_len, avail_ring, used_ring, desc, notify, cookie, 0);
+}
+
+void virtqueue_init_driver_features(virtqueue_driver_t *vq, unsigned queue_len, vq_vring_avail_t *avail_ring,
+                                    vq_vring_used_t *used_ring, vq_vring_desc_t *desc, void (*notify)(void),
+                                    void *cookie, unsigned features)
 {
     if (!IS_POWER_OF_2(queue_len)) {
         ZF_LOGE("Invalid queue_len: %d, must be a power of 2.", queue_len);
     }
     vq->free_desc_head = 0;
     vq->queue_len = queue_len;
-    vq->u_ring_last_seen = vq->queue_len - 1;
+    vq->u_ring_last_seen = (uint16_t) -1;
+    vq->features = features;
+    vq->a_ring_notified = 0;
     vq->avail_ring = avail_ring;
     vq->used_ring = used_ring;
     vq->desc_table = desc;
+    vq->packed_ring = NULL;
+    vq->driver_event = NULL;
+    vq->device_event = NULL;
+    vq->pool = NULL;
+    vq->pool_size = 0;
+    vq->chain_info = NULL;
+    vq->buf_pool = NULL;
+    vq->desc_alloc = 0;
+    vq->desc_freed = 0;
+    vq->a_ring_completed = 0;
+    vq->in_order_id = queue_len;
     vq->notify = notify;
     vq->cookie = cookie;
+    vq_stats_init(VQ_STATS(vq));
     virtqueue_init_desc_table(desc, vq->queue_len);
     virtqueue_init_avail_ring(avail_ring);
     virtqueue_init_used_ring(used_ring);
-
+    if (features & VQ_F_EVENT_IDX) {
+        VQ_USED_EVENT(vq) = 0;
+        VQ_AVAIL_EVENT(vq) = 0;
+    }
 }
 
 void virtqueue_init_device(virtqueue_device_t *vq, unsigned queue_len, vq_vring_avail_t *avail_ring,
                            vq_vring_used_t *used_ring, vq_vring_desc_t *desc, void (*notify)(void),
                            void *cookie)
+{
+    virtqueue_init_device_features(vq, queue_len, avail_ring, used_ring, desc, notify, cookie, 0);
+}
+
+void virtqueue_init_device_features(virtqueue_device_t *vq, unsigned queue_len, vq_vring_avail_t *avail_ring,
+                                    vq_vring_used_t *used_ring, vq_vring_desc_t *desc, void (*notify)(void),
+                                    void *cookie, unsigned features)
 {
     if (!IS_POWER_OF_2(queue_len)) {
         ZF_LOGE("Invalid queue_len: %d, must be a power of 2.", queue_len);
     }
     vq->queue_len = queue_len;
-    vq->a_ring_last_seen = vq->queue_len - 1;
+    vq->a_ring_last_seen = (uint16_t) -1;
+    vq->features = features;
+    vq->u_ring_notified = 0;
     vq->avail_ring = avail_ring;
     vq->used_ring = used_ring;
     vq->desc_table = desc;
+    vq->packed_ring = NULL;
+    vq->driver_event = NULL;
+    vq->device_event = NULL;
+    vq->pool = NULL;
+    vq->pool_size = 0;
+    vq->chain_info = NULL;
+    vq->notify = notify;
+    vq->cookie = cookie;
+    vq_stats_init(VQ_STATS(vq));
+}
+
+void virtqueue_init_driver_packed(virtqueue_driver_t *vq, unsigned queue_len, vq_packed_desc_t *ring,
+                                  vq_packed_event_t *driver_event, vq_packed_event_t *device_event,
+                                  vq_vring_desc_t *desc, void (*notify)(void), void *cookie,
+                                  unsigned features)
+{
+    if (!IS_POWER_OF_2(queue_len) || queue_len > BIT(15)) {
+        ZF_LOGE("Invalid queue_len: %d, must be a power of 2 no larger than %d.", queue_len, (int)BIT(15));
+    }
+    vq->free_desc_head = 0;
+    vq->queue_len = queue_len;
+    vq->u_ring_last_seen = (uint16_t) -1;
+    if (features & VQ_F_IN_ORDER) {
+        ZF_LOGE("VQ_F_IN_ORDER is not supported with the packed ring format");
+        features &= ~VQ_F_IN_ORDER;
+    }
+    vq->features = features | VQ_F_RING_PACKED;
+    vq->a_ring_notified = 0;
+    vq->avail_ring = NULL;
+    vq->used_ring = NULL;
+    vq->desc_table = desc;
+    vq->packed_ring = ring;
+    vq->driver_event = driver_event;
+    vq->device_event = device_event;
+    vq->p_avail = 0;
+    vq->p_used = 0;
+    vq->pool = NULL;
+    vq->pool_size = 0;
+    vq->chain_info = NULL;
+    vq->buf_pool = NULL;
     vq->notify = notify;
     vq->cookie = cookie;
+    vq_stats_init(VQ_STATS(vq));
+    virtqueue_init_desc_table(desc, vq->queue_len);
+    vq_packed_init_driver(vq);
+}
+
+void virtqueue_init_device_packed(virtqueue_device_t *vq, unsigned queue_len, vq_packed_desc_t *ring,
+                                  vq_packed_event_t *driver_event, vq_packed_event_t *device_event,
+                                  void (*notify)(void), void *cookie, unsigned features)
+{
+    if (!IS_POWER_OF_2(queue_len) || queue_len > BIT(15)) {
+        ZF_LOGE("Invalid queue_len: %d, must be a power of 2 no larger than %d.", queue_len, (int)BIT(15));
+    }
+    vq->queue_len = queue_len;
+    vq->a_ring_last_seen = (uint16_t) -1;
+    if (features & VQ_F_IN_ORDER) {
+        ZF_LOGE("VQ_F_IN_ORDER is not supported with the packed ring format");
+        features &= ~VQ_F_IN_ORDER;
+    }
+    vq->features = features | VQ_F_RING_PACKED;
+    vq->u_ring_notified = 0;
+    vq->avail_ring = NULL;
+    vq->used_ring = NULL;
+    vq->desc_table = NULL;
+    vq->packed_ring = ring;
+    vq->driver_event = driver_event;
+    vq->device_event = device_event;
+    vq->p_avail = 0;
+    vq->p_used = 0;
+    vq->p_done = 0;
+    vq->pool = NULL;
+    vq->pool_size = 0;
+    vq->chain_info = NULL;
+    vq->notify = notify;
+    vq->cookie = cookie;
+    vq_stats_init(VQ_STATS(vq));
+}
+
+int virtqueue_layout(vq_layout_t *layout, unsigned queue_len, unsigned features, size_t pool_size)
+{
+    size_t avail_size, used_size;
+
+    if (!IS_POWER_OF_2(queue_len) || queue_len == 0 || queue_len > BIT(15)) {
+        ZF_LOGE("Invalid queue_len: %d, must be a power of 2 no larger than %d.", queue_len, (int)BIT(15));
+        return -1;
+    }
+
+    if (features & VQ_F_RING_PACKED) {
+        layout->desc = 0;
+        layout->avail = ROUND_UP(layout->desc + queue_len * sizeof(vq_packed_desc_t), VQ_CACHE_LINE);
+        avail_size = sizeof(vq_packed_event_t);
+        used_size = sizeof(vq_packed_event_t);
+    } else {
+        layout->desc = 0;
+        layout->avail = ROUND_UP(layout->desc + queue_len * sizeof(vq_vring_desc_t), VQ_CACHE_LINE);
+        /* The event indices take an extra uint16_t at the end of each ring */
+        avail_size = sizeof(vq_vring_avail_t) + (queue_len + 1) * sizeof(uint16_t);
+        used_size = sizeof(vq_vring_used_t) + queue_len * sizeof(vq_vring_used_elem_t) + sizeof(uint16_t);
+    }
+    layout->used = ROUND_UP(layout->avail + avail_size, VQ_CACHE_LINE);
+    layout->pool = ROUND_UP(layout->used + used_size, VQ_CACHE_LINE);
+    if (features & VQ_F_CHAIN_INFO) {
+        layout->chain = layout->pool;
+        layout->pool = ROUND_UP(layout->chain + queue_len * sizeof(vq_chain_info_t), VQ_CACHE_LINE);
+    } else {
+        layout->chain = 0;
+    }
+    layout->size = ROUND_UP(layout->pool + pool_size, VQ_CACHE_LINE);
+    return 0;
+}
+
+void virtqueue_driver_set_pool(virtqueue_driver_t *vq, void *pool, size_t pool_size)
+{
+    vq->pool = pool;
+    vq->pool_size = pool_size;
+}
+
+void virtqueue_driver_set_buf_pool(virtqueue_driver_t *vq, struct vq_pool *buf_pool)
+{
+    vq->buf_pool = buf_pool;
+}
+
+void virtqueue_device_set_pool(virtqueue_device_t *vq, void *pool, size_t pool_size)
+{
+    vq->pool = pool;
+    vq->pool_size = pool_size;
+}
+
+void virtqueue_driver_set_chain_info(virtqueue_driver_t *vq, vq_chain_info_t *table)
+{
+    vq->chain_info = table;
+}
+
+void virtqueue_device_set_chain_info(virtqueue_device_t *vq, vq_chain_info_t *table)
+{
+    vq->chain_info = table;
 }
 
 void virtqueue_init_desc_table(vq_vring_desc_t *table, unsigned queue_len)
@@ -67,23 +260,28 @@ void virtqueue_init_used_ring(vq_vring_used_t *ring)
     ring->idx = 0;
 }
 
-static unsigned vq_add_desc(virtqueue_driver_t *vq, void *buf, unsigned len,
-                            vq_flags_t flag, int prev)
+unsigned vq_add_desc(virtqueue_driver_t *vq, void *buf, unsigned len,
+                     vq_flags_t flag, unsigned prev)
 {
     unsigned new;
     vq_vring_desc_t *desc;
 
-    new = vq->free_desc_head;
-    if (new == vq->queue_len) {
-        return new;
+    if (vq->features & VQ_F_IN_ORDER) {
+        /* Descriptors are used up and given back in ring order */
+        if ((uint16_t)(vq->desc_alloc - vq->desc_freed) == vq->queue_len) {
+            return vq->queue_len;
+        }
+        new = vq->desc_alloc++ & (vq->queue_len - 1);
+    } else {
+        new = vq->free_desc_head;
+        if (new == vq->queue_len) {
+            return new;
+        }
+        vq->free_desc_head = vq->desc_table[new].next;
     }
-    vq->free_desc_head = vq->desc_table[new].next;
     desc = vq->desc_table + new;
 
-    // casting pointers to integers directly is not allowed, must cast the
-    // pointer to a uintptr_t first
-    desc->addr = (uintptr_t)buf;
-
+    desc->addr = virtqueue_driver_buf_addr(vq, buf);
     desc->len = len;
     desc->flags = flag;
     desc->next = vq->queue_len;
@@ -95,28 +293,76 @@ static unsigned vq_add_desc(virtqueue_driver_t *vq, void *buf, unsigned len,
     return new;
 }
 
-static unsigned vq_pop_desc(virtqueue_driver_t *vq, unsigned idx,
-                            void **buf, unsigned *len, vq_flags_t *flag)
+unsigned vq_pop_desc(virtqueue_driver_t *vq, unsigned idx,
+                     void **buf, unsigned *len, vq_flags_t *flag)
 {
     unsigned next = vq->desc_table[idx].next;
 
-    // casting integers to pointers directly is not allowed, must cast the
-    // integer to a uintptr_t first
-    *buf = (void *)(uintptr_t)(vq->desc_table[idx].addr);
-
+    *buf = virtqueue_driver_buf_ptr(vq, vq->desc_table[idx].addr);
     *len = vq->desc_table[idx].len;
     *flag = vq->desc_table[idx].flags;
-    vq->desc_table[idx].next = vq->free_desc_head;
-    vq->free_desc_head = idx;
+    if (vq->features & VQ_F_IN_ORDER) {
+        vq->desc_freed++;
+    } else {
+        vq->desc_table[idx].next = vq->free_desc_head;
+        vq->free_desc_head = idx;
+    }
 
     return next;
 }
 
-int virtqueue_add_available_buf(virtqueue_driver_t *vq, virtqueue_ring_object_t *obj,
-                                void *buf, unsigned len, vq_flags_t flag)
+/* Give back the descriptors of a chain that was never made available */
+static void vq_unwind_chain(virtqueue_driver_t *vq, unsigned first, unsigned count)
+{
+    void *buf;
+    unsigned len;
+    vq_flags_t flag;
+
+    if (vq->features & VQ_F_IN_ORDER) {
+        vq->desc_alloc -= count;
+        return;
+    }
+    while (first < vq->queue_len) {
+        first = vq_pop_desc(vq, first, &buf, &len, &flag);
+    }
+}
+
+/* The descriptor that the next buffer list will start at */
+static inline unsigned vq_next_head(virtqueue_driver_t *vq)
+{
+    if (vq->features & VQ_F_IN_ORDER) {
+        return vq->desc_alloc & (vq->queue_len - 1);
+    }
+    return vq->free_desc_head;
+}
+
+/* Record the summary of an indirect table, from the driver's own copy of it */
+static void vq_set_indirect_chain_info(virtqueue_driver_t *vq, unsigned head, vq_vring_desc_t *table,
+                                       unsigned len)
+{
+    unsigned count = len / sizeof(*table);
+    unsigned i;
+
+    if (vq->chain_info == NULL) {
+        return;
+    }
+    vq->chain_info[head].len = 0;
+    vq->chain_info[head].count = count;
+    for (i = 0; i < count; i++) {
+        vq->chain_info[head].len += table[i].len;
+    }
+}
+
+static int vq_split_add_available_buf(virtqueue_driver_t *vq, virtqueue_ring_object_t *obj,
+                                      void *buf, unsigned len, vq_flags_t flag)
 {
     unsigned idx;
 
+    if (obj->first < vq->queue_len && vq->chain_info != NULL) {
+        /* The device may already have read the summary of the published list */
+        ZF_LOGE("Can't extend a list that is already available while recording chain information");
+        return 0;
+    }
     /* If descriptor table full */
     if ((idx = vq_add_desc(vq, buf, len, flag, obj->cur)) == vq->queue_len) {
         return 0;
@@ -125,64 +371,685 @@ int virtqueue_add_available_buf(virtqueue_driver_t *vq, virtqueue_ring_object_t
 
     /* If this is the first buffer in the descriptor chain */
     if (obj->first >= vq->queue_len) {
+        uint16_t avail_idx = vq->avail_ring->idx;
+        if (flag == VQ_DESC_F_INDIRECT) {
+            vq_set_indirect_chain_info(vq, idx, buf, len);
+        } else {
+            vq_buf_t b = { .buf = buf, .len = len, .flag = flag };
+            vq_set_chain_info(vq, idx, &b, 1);
+        }
         obj->first = idx;
-        vq->avail_ring->ring[vq->avail_ring->idx] = idx;
-        vq->avail_ring->idx = (vq->avail_ring->idx + 1) & (vq->queue_len - 1);
+        vq->avail_ring->ring[avail_idx & (vq->queue_len - 1)] = idx;
+        vq_store_idx(&vq->avail_ring->idx, avail_idx + 1);
     }
     return 1;
 }
 
+int virtqueue_add_available_buf(virtqueue_driver_t *vq, virtqueue_ring_object_t *obj,
+                                void *buf, unsigned len, vq_flags_t flag)
+{
+    int new_list = obj->first >= vq->queue_len;
+    unsigned head = vq_next_head(vq);
+    int ret;
+
+    if (vq->features & VQ_F_RING_PACKED) {
+        ret = vq_packed_add_available_buf(vq, obj, buf, len, flag);
+    } else {
+        ret = vq_split_add_available_buf(vq, obj, buf, len, flag);
+    }
+    /* Buffers added to the end of a list don't make a new one */
+    if (new_list || !ret) {
+        vq_stats_add(VQ_STATS(vq), ret, 1);
+        vq_stats_sample_start(VQ_STATS(vq), ret && new_list, head);
+    }
+    return ret;
+}
+
+static unsigned vq_split_add_available_bufs(virtqueue_driver_t *vq, const vq_buf_t *bufs, unsigned n)
+{
+    unsigned mask = vq->queue_len - 1;
+    uint16_t idx = vq->avail_ring->idx;
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        unsigned desc = vq_add_desc(vq, bufs[i].buf, bufs[i].len, bufs[i].flag, vq->queue_len);
+        if (desc == vq->queue_len) {
+            break;
+        }
+        vq_set_chain_info(vq, desc, bufs + i, 1);
+        vq->avail_ring->ring[idx & mask] = desc;
+        idx++;
+    }
+
+    if (i > 0) {
+        /* Publish all of the new entries at once */
+        vq_store_idx(&vq->avail_ring->idx, idx);
+    }
+    return i;
+}
+
+unsigned virtqueue_add_available_bufs(virtqueue_driver_t *vq, const vq_buf_t *bufs, unsigned n)
+{
+    unsigned head = vq_next_head(vq);
+    unsigned ret;
+
+    if (vq->features & VQ_F_RING_PACKED) {
+        ret = vq_packed_add_available_bufs(vq, bufs, n);
+    } else {
+        ret = vq_split_add_available_bufs(vq, bufs, n);
+    }
+    vq_stats_add(VQ_STATS(vq), ret, n);
+    vq_stats_sample_start(VQ_STATS(vq), ret, head);
+    return ret;
+}
+
+static int vq_split_add_available_chain(virtqueue_driver_t *vq, const vq_buf_t *bufs, unsigned n)
+{
+    unsigned first = vq->queue_len;
+    unsigned prev = vq->queue_len;
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        unsigned idx = vq_add_desc(vq, bufs[i].buf, bufs[i].len, bufs[i].flag, prev);
+        if (idx == vq->queue_len) {
+            /* Give back what we took so far */
+            vq_unwind_chain(vq, first, i);
+            return 0;
+        }
+        if (first == vq->queue_len) {
+            first = idx;
+        }
+        prev = idx;
+    }
+    vq_set_chain_info(vq, first, bufs, n);
+
+    vq->avail_ring->ring[vq->avail_ring->idx & (vq->queue_len - 1)] = first;
+    vq_store_idx(&vq->avail_ring->idx, vq->avail_ring->idx + 1);
+    return 1;
+}
+
+int virtqueue_add_available_chain(virtqueue_driver_t *vq, const vq_buf_t *bufs, unsigned n)
+{
+    unsigned head = vq_next_head(vq);
+    int ret;
+
+    if (n == 0) {
+        return 0;
+    }
+    if (vq->features & VQ_F_RING_PACKED) {
+        ret = vq_packed_add_available_chain(vq, bufs, n);
+    } else {
+        ret = vq_split_add_available_chain(vq, bufs, n);
+    }
+    vq_stats_add(VQ_STATS(vq), ret, 1);
+    vq_stats_sample_start(VQ_STATS(vq), ret, head);
+    return ret;
+}
+
+int virtqueue_add_available_indirect(virtqueue_driver_t *vq, virtqueue_ring_object_t *obj,
+                                     vq_vring_desc_t *table, const vq_buf_t *bufs, unsigned n)
+{
+    unsigned i;
+
+    if (vq->features & VQ_F_RING_PACKED) {
+        ZF_LOGE("Indirect descriptors are not supported in a packed ring");
+        return 0;
+    }
+
+    for (i = 0; i < n; i++) {
+        table[i].addr = virtqueue_driver_buf_addr(vq, bufs[i].buf);
+        table[i].len = bufs[i].len;
+        table[i].flags = bufs[i].flag;
+        table[i].next = i + 1;
+    }
+    /* The table is published to the device by the ring index update, which is ordered after
+     * these writes */
+    return virtqueue_add_available_buf(vq, obj, table, n * sizeof(*table), VQ_DESC_F_INDIRECT);
+}
+
 int virtqueue_get_used_buf(virtqueue_driver_t *vq, virtqueue_ring_object_t *obj, uint32_t *len)
 {
-    unsigned next = (vq->u_ring_last_seen + 1) & (vq->queue_len - 1);
+    return virtqueue_get_used_bufs(vq, obj, len, 1);
+}
+
+/* A used entry in in-order mode completes every list made available up to and including the one
+ * it names, so the lists are taken from the available ring rather than the used ring */
+static unsigned vq_get_used_bufs_in_order(virtqueue_driver_t *vq, virtqueue_ring_object_t *robjs,
+                                          uint32_t *lens, unsigned n)
+{
+    unsigned mask = vq->queue_len - 1;
+    uint16_t next = vq->u_ring_last_seen + 1;
+    uint16_t idx = vq_load_idx(&vq->used_ring->idx);
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        unsigned head;
+
+        if (vq->in_order_id == vq->queue_len) {
+            if (next == idx) {
+                break;
+            }
+            vq->in_order_id = vq->used_ring->ring[next & mask].id;
+            vq->in_order_len = vq->used_ring->ring[next & mask].len;
+            vq->u_ring_last_seen = next;
+            next++;
+        }
+        if (vq->a_ring_completed == vq->avail_ring->idx) {
+            ZF_LOGE("Used entry %d does not match any available entry", vq->in_order_id);
+            vq->in_order_id = vq->queue_len;
+            break;
+        }
+        head = vq->avail_ring->ring[vq->a_ring_completed & mask];
+        vq->a_ring_completed++;
+
+        robjs[i].first = head;
+        robjs[i].cur = head;
+        robjs[i].indirect = NULL;
+        robjs[i].recycle = NULL;
+        if (head == vq->in_order_id) {
+            lens[i] = vq->in_order_len;
+            vq->in_order_id = vq->queue_len;
+        } else {
+            lens[i] = 0;
+        }
+    }
+    return i;
+}
+
+static unsigned vq_split_get_used_bufs(virtqueue_driver_t *vq, virtqueue_ring_object_t *robjs, uint32_t *lens,
+                                       unsigned n)
+{
+    unsigned mask = vq->queue_len - 1;
+    uint16_t next = vq->u_ring_last_seen + 1;
+    uint16_t idx = vq_load_idx(&vq->used_ring->idx);
+    unsigned i;
+
+    for (i = 0; i < n && next != idx; i++) {
+        robjs[i].first = vq->used_ring->ring[next & mask].id;
+        robjs[i].cur = robjs[i].first;
+        robjs[i].indirect = NULL;
+        robjs[i].recycle = NULL;
+        lens[i] = vq->used_ring->ring[next & mask].len;
+        vq->u_ring_last_seen = next;
+        next++;
+    }
+    return i;
+}
 
-    if (next == vq->used_ring->idx) {
+unsigned virtqueue_get_used_bufs(virtqueue_driver_t *vq, virtqueue_ring_object_t *robjs, uint32_t *lens,
+                                 unsigned n)
+{
+    unsigned ret;
+
+    if (vq->features & VQ_F_RING_PACKED) {
+        ret = vq_packed_get_used_bufs(vq, robjs, lens, n);
+    } else if (vq->features & VQ_F_IN_ORDER) {
+        ret = vq_get_used_bufs_in_order(vq, robjs, lens, n);
+    } else {
+        ret = vq_split_get_used_bufs(vq, robjs, lens, n);
+    }
+    vq_stats_get(VQ_STATS(vq), ret);
+    vq_stats_sample_end(VQ_STATS(vq), robjs, ret);
+    return ret;
+}
+
+unsigned virtqueue_reclaim_used_in_order(virtqueue_driver_t *vq, uint32_t *len)
+{
+    unsigned mask = vq->queue_len - 1;
+    uint16_t avail = vq->avail_ring->idx;
+    uint16_t lo = vq->a_ring_completed;
+    uint16_t hi = avail;
+    uint16_t first = vq->desc_freed;
+    uint16_t freed;
+    unsigned target;
+    unsigned n;
+
+    if (!(vq->features & VQ_F_IN_ORDER) || (vq->features & VQ_F_RING_PACKED)) {
+        ZF_LOGE("Range reclaim needs an in-order split ring");
         return 0;
     }
-    obj->first = vq->used_ring->ring[next].id;
-    *len = vq->used_ring->ring[next].len;
-    obj->cur = obj->first;
-    vq->u_ring_last_seen = next;
-    return 1;
+    if (vq->in_order_id == vq->queue_len) {
+        uint16_t next = vq->u_ring_last_seen + 1;
+
+        if (next == vq_load_idx(&vq->used_ring->idx)) {
+            vq_stats_get(VQ_STATS(vq), 0);
+            return 0;
+        }
+        vq->in_order_id = vq->used_ring->ring[next & mask].id;
+        vq->in_order_len = vq->used_ring->ring[next & mask].len;
+        vq->u_ring_last_seen = next;
+    }
+
+    /* The lists in flight hold consecutive descriptors starting at desc_freed, so their heads
+     * sit at increasing offsets from it and the named one can be found by bisection */
+    target = (vq->in_order_id - first) & mask;
+    while (lo != hi) {
+        uint16_t mid = lo + (uint16_t)(hi - lo) / 2;
+
+        if (((vq->avail_ring->ring[mid & mask] - first) & mask) < target) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == avail || vq->avail_ring->ring[lo & mask] != vq->in_order_id) {
+        ZF_LOGE("Used entry %d does not match any available entry", vq->in_order_id);
+        vq->in_order_id = vq->queue_len;
+        return 0;
+    }
+
+    /* Everything up to the head of the next list in flight is given back at once */
+    lo++;
+    if (lo == avail) {
+        freed = vq->desc_alloc;
+    } else {
+        freed = first + ((vq->avail_ring->ring[lo & mask] - first) & mask);
+    }
+    n = (uint16_t)(lo - vq->a_ring_completed);
+    vq->a_ring_completed = lo;
+    vq->desc_freed = freed;
+    *len = vq->in_order_len;
+    vq->in_order_id = vq->queue_len;
+
+    vq_stats_get(VQ_STATS(vq), n);
+    vq_stats_sample_end_range(VQ_STATS(vq), first & mask, (uint16_t)(freed - first), mask);
+    return n;
 }
 
 int virtqueue_add_used_buf(virtqueue_device_t *vq, virtqueue_ring_object_t *robj, uint32_t len)
 {
-    unsigned cur = vq->used_ring->idx;
+    return virtqueue_add_used_bufs(vq, robj, &len, 1);
+}
+
+static unsigned vq_split_add_used_bufs(virtqueue_device_t *vq, virtqueue_ring_object_t *robjs,
+                                       const uint32_t *lens, unsigned n)
+{
+    unsigned mask = vq->queue_len - 1;
+    uint16_t idx = vq->used_ring->idx;
+    unsigned i;
 
-    vq->used_ring->ring[cur].id = robj->first;
-    vq->used_ring->ring[cur].len = len;
-    vq->used_ring->idx = (cur + 1) & (vq->queue_len - 1);
-    return 1;
+    if (n == 0) {
+        return 0;
+    }
+
+    if (vq->features & VQ_F_IN_ORDER) {
+        /* The last list of the batch stands for all of them */
+        vq->used_ring->ring[idx & mask].id = robjs[n - 1].first;
+        vq->used_ring->ring[idx & mask].len = lens[n - 1];
+        idx++;
+    } else {
+        for (i = 0; i < n; i++) {
+            vq->used_ring->ring[idx & mask].id = robjs[i].first;
+            vq->used_ring->ring[idx & mask].len = lens[i];
+            idx++;
+        }
+    }
+
+    /* Publish all of the new entries at once */
+    vq_store_idx(&vq->used_ring->idx, idx);
+    return n;
+}
+
+unsigned virtqueue_add_used_bufs(virtqueue_device_t *vq, virtqueue_ring_object_t *robjs, const uint32_t *lens,
+                                 unsigned n)
+{
+    unsigned ret;
+
+    if (vq->features & VQ_F_RING_PACKED) {
+        ret = vq_packed_add_used_bufs(vq, robjs, lens, n);
+    } else {
+        ret = vq_split_add_used_bufs(vq, robjs, lens, n);
+    }
+    vq_stats_add(VQ_STATS(vq), ret, n);
+    vq_stats_sample_end(VQ_STATS(vq), robjs, ret);
+    return ret;
 }
 
 int virtqueue_get_available_buf(virtqueue_device_t *vq, virtqueue_ring_object_t *robj)
 {
-    unsigned next = (vq->a_ring_last_seen + 1) & (vq->queue_len - 1);
+    return virtqueue_get_available_bufs(vq, robj, 1);
+}
+
+static unsigned vq_split_get_available_bufs(virtqueue_device_t *vq, virtqueue_ring_object_t *robjs, unsigned n)
+{
+    unsigned mask = vq->queue_len - 1;
+    uint16_t next = vq->a_ring_last_seen + 1;
+    uint16_t idx = vq_load_idx(&vq->avail_ring->idx);
+    unsigned i;
 
-    if (next == vq->avail_ring->idx) {
-        return 0;
+    for (i = 0; i < n && next != idx; i++) {
+        robjs[i].first = vq->avail_ring->ring[next & mask];
+        robjs[i].cur = robjs[i].first;
+        robjs[i].indirect = NULL;
+        vq->a_ring_last_seen = next;
+        next++;
     }
-    robj->first = vq->avail_ring->ring[next];
-    robj->cur = robj->first;
-    vq->a_ring_last_seen = next;
-    return 1;
+    return i;
+}
+
+unsigned virtqueue_get_available_bufs(virtqueue_device_t *vq, virtqueue_ring_object_t *robjs, unsigned n)
+{
+    unsigned ret;
+
+    if (vq->features & VQ_F_RING_PACKED) {
+        ret = vq_packed_get_available_bufs(vq, robjs, n);
+    } else {
+        ret = vq_split_get_available_bufs(vq, robjs, n);
+    }
+    vq_stats_get(VQ_STATS(vq), ret);
+    vq_stats_sample_start(VQ_STATS(vq), ret, ret ? robjs[0].first : 0);
+    return ret;
+}
+
+/* Whether moving a ring index from old to new_idx has passed the peer's event index, i.e.
+ * whether event lies in [old, new_idx) */
+static int vq_need_event(uint16_t event, uint16_t new_idx, uint16_t old)
+{
+    return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old);
+}
+
+int virtqueue_driver_poll(virtqueue_driver_t *vq)
+{
+    if (vq->features & VQ_F_RING_PACKED) {
+        return vq_packed_driver_poll(vq);
+    }
+    if (vq->in_order_id != vq->queue_len) {
+        /* The rest of a used batch is still to be returned */
+        return 1;
+    }
+    return (uint16_t)(vq->u_ring_last_seen + 1) != vq_load_idx(&vq->used_ring->idx);
+}
+
+static int vq_split_driver_should_notify(virtqueue_driver_t *vq)
+{
+    uint16_t old = vq->a_ring_notified;
+    uint16_t new_idx = vq->avail_ring->idx;
+    int notify;
+
+    /* Our index update must be visible before we look at whether the device is waiting,
+     * otherwise we could miss a device that is just going to sleep */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (vq->features & VQ_F_EVENT_IDX) {
+        notify = vq_need_event(VQ_AVAIL_EVENT(vq), new_idx, old);
+    } else {
+        notify = !(vq->used_ring->flags & VQ_USED_F_NO_NOTIFY);
+    }
+    vq->a_ring_notified = new_idx;
+    return notify;
+}
+
+int virtqueue_driver_should_notify(virtqueue_driver_t *vq)
+{
+    int notify;
+
+    if (vq->features & VQ_F_RING_PACKED) {
+        notify = vq_packed_driver_should_notify(vq);
+    } else {
+        notify = vq_split_driver_should_notify(vq);
+    }
+    vq_stats_notify(VQ_STATS(vq), notify);
+    return notify;
+}
+
+int virtqueue_driver_enable_notify(virtqueue_driver_t *vq)
+{
+    if (vq->features & VQ_F_RING_PACKED) {
+        return vq_packed_driver_enable_notify(vq);
+    }
+    if (vq->features & VQ_F_EVENT_IDX) {
+        VQ_USED_EVENT(vq) = vq->u_ring_last_seen + 1;
+    } else {
+        vq->avail_ring->flags &= ~VQ_AVAIL_F_NO_INTERRUPT;
+    }
+    /* Publish the request before checking for buffers the device added in the meantime */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return VQ_DRV_POLL(vq);
+}
+
+void virtqueue_driver_disable_notify(virtqueue_driver_t *vq)
+{
+    if (vq->features & VQ_F_RING_PACKED) {
+        vq_packed_driver_disable_notify(vq);
+        return;
+    }
+    /* With event indices the device stops notifying once it passes the last used_event */
+    if (!(vq->features & VQ_F_EVENT_IDX)) {
+        vq->avail_ring->flags |= VQ_AVAIL_F_NO_INTERRUPT;
+    }
+}
+
+int virtqueue_device_poll(virtqueue_device_t *vq)
+{
+    if (vq->features & VQ_F_RING_PACKED) {
+        return vq_packed_device_poll(vq);
+    }
+    return (uint16_t)(vq->a_ring_last_seen + 1) != vq_load_idx(&vq->avail_ring->idx);
+}
+
+static int vq_split_device_should_notify(virtqueue_device_t *vq)
+{
+    uint16_t old = vq->u_ring_notified;
+    uint16_t new_idx = vq->used_ring->idx;
+    int notify;
+
+    /* Our index update must be visible before we look at whether the driver is waiting */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (vq->features & VQ_F_EVENT_IDX) {
+        notify = vq_need_event(VQ_USED_EVENT(vq), new_idx, old);
+    } else {
+        notify = !(vq->avail_ring->flags & VQ_AVAIL_F_NO_INTERRUPT);
+    }
+    vq->u_ring_notified = new_idx;
+    return notify;
+}
+
+int virtqueue_device_should_notify(virtqueue_device_t *vq)
+{
+    int notify;
+
+    if (vq->features & VQ_F_RING_PACKED) {
+        notify = vq_packed_device_should_notify(vq);
+    } else {
+        notify = vq_split_device_should_notify(vq);
+    }
+    vq_stats_notify(VQ_STATS(vq), notify);
+    return notify;
+}
+
+int virtqueue_device_enable_notify(virtqueue_device_t *vq)
+{
+    if (vq->features & VQ_F_RING_PACKED) {
+        return vq_packed_device_enable_notify(vq);
+    }
+    if (vq->features & VQ_F_EVENT_IDX) {
+        VQ_AVAIL_EVENT(vq) = vq->a_ring_last_seen + 1;
+    } else {
+        vq->used_ring->flags &= ~VQ_USED_F_NO_NOTIFY;
+    }
+    /* Publish the request before checking for buffers the driver added in the meantime */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return VQ_DEV_POLL(vq);
+}
+
+void virtqueue_device_disable_notify(virtqueue_device_t *vq)
+{
+    if (vq->features & VQ_F_RING_PACKED) {
+        vq_packed_device_disable_notify(vq);
+        return;
+    }
+    /* With event indices the driver stops notifying once it passes the last avail_event */
+    if (!(vq->features & VQ_F_EVENT_IDX)) {
+        vq->used_ring->flags |= VQ_USED_F_NO_NOTIFY;
+    }
+}
+
+void vq_poller_init(vq_poller_t *poller, unsigned spin_min, unsigned spin_max,
+                    void (*wait)(void *cookie), void *cookie)
+{
+    poller->wait = wait;
+    poller->cookie = cookie;
+    poller->spin_min = MIN(spin_min, spin_max);
+    poller->spin_max = spin_max;
+    poller->spin = spin_max;
+}
+
+/* The budget was too short for the gap between buffers, so make room for a longer one. A budget
+ * of 0 grows to 1 so that it can grow further. */
+static void vq_poller_grow(vq_poller_t *poller)
+{
+    unsigned spin = poller->spin > poller->spin_max / 2 ? poller->spin_max : MAX(poller->spin * 2, 1);
+
+    poller->spin = MIN(spin, poller->spin_max);
+}
+
+/* Buffers turned up after i polls. If that was late in the budget, the next gap may well be
+ * longer than the budget. Buffers that were already there on the first poll say nothing about
+ * the gap, so they leave the budget alone. */
+static void vq_poller_found(vq_poller_t *poller, unsigned i)
+{
+    if (i > 0 && i >= poller->spin / 2) {
+        vq_poller_grow(poller);
+    }
+}
+
+/* The polls ran out. If turning on notifications found buffers, they turned up just after the
+ * budget and it should grow; otherwise the consumer is about to block and the polls were wasted. */
+static void vq_poller_blocked(vq_poller_t *poller, int pending)
+{
+    if (pending) {
+        vq_poller_grow(poller);
+    } else {
+        poller->spin = MAX(poller->spin / 2, poller->spin_min);
+    }
+}
+
+void virtqueue_driver_wait(virtqueue_driver_t *vq, vq_poller_t *poller)
+{
+    unsigned i;
+    int pending;
+
+    for (i = 0; i < poller->spin; i++) {
+        if (VQ_DRV_POLL(vq)) {
+            vq_poller_found(poller, i);
+            return;
+        }
+    }
+    /* Turning notifications on checks the ring again, so a buffer that was used between the last
+     * poll and the device seeing the request isn't missed */
+    pending = virtqueue_driver_enable_notify(vq);
+    vq_poller_blocked(poller, pending);
+    while (!pending) {
+        poller->wait(poller->cookie);
+        pending = virtqueue_driver_enable_notify(vq);
+    }
+    virtqueue_driver_disable_notify(vq);
+}
+
+void virtqueue_device_wait(virtqueue_device_t *vq, vq_poller_t *poller)
+{
+    unsigned i;
+    int pending;
+
+    for (i = 0; i < poller->spin; i++) {
+        if (VQ_DEV_POLL(vq)) {
+            vq_poller_found(poller, i);
+            return;
+        }
+    }
+    pending = virtqueue_device_enable_notify(vq);
+    vq_poller_blocked(poller, pending);
+    while (!pending) {
+        poller->wait(poller->cookie);
+        pending = virtqueue_device_enable_notify(vq);
+    }
+    virtqueue_device_disable_notify(vq);
 }
 
 void virtqueue_init_ring_object(virtqueue_ring_object_t *obj)
 {
     obj->cur = (uint32_t) -1;
     obj->first = (uint32_t) -1;
+    obj->indirect = NULL;
+    obj->recycle = NULL;
+}
+
+/* Start iterating through an indirect table */
+static void vq_enter_indirect(virtqueue_ring_object_t *robj, void *table, unsigned len)
+{
+    robj->indirect = table;
+    robj->indirect_len = len / sizeof(vq_vring_desc_t);
+    robj->indirect_cur = 0;
+}
+
+/* Get the next entry from the indirect table being iterated, if there is one */
+static vq_vring_desc_t *vq_next_indirect(virtqueue_ring_object_t *robj)
+{
+    vq_vring_desc_t *desc;
+
+    if (robj->indirect == NULL) {
+        return NULL;
+    }
+    if (robj->indirect_cur >= robj->indirect_len) {
+        robj->indirect = NULL;
+        return NULL;
+    }
+    desc = robj->indirect + robj->indirect_cur;
+    robj->indirect_cur = desc->next;
+    return desc;
+}
+
+/* Translate the buffer of a descriptor on the device side */
+static int vq_device_buf(virtqueue_device_t *vq, vq_vring_desc_t *desc, void **buf)
+{
+    *buf = virtqueue_device_buf_ptr(vq, desc->addr, desc->len);
+    if (*buf == NULL && vq->pool_size != 0) {
+        ZF_LOGE("Buffer at %llx is outside of the pool", (unsigned long long)desc->addr);
+        return 0;
+    }
+    return 1;
+}
+
+/* The chain information the driver recorded for a list, or NULL if there is none */
+static vq_chain_info_t *vq_device_chain_info(virtqueue_device_t *vq, virtqueue_ring_object_t *robj)
+{
+    unsigned id = (vq->features & VQ_F_RING_PACKED) ? robj->id : robj->first;
+
+    if (vq->chain_info == NULL || id >= vq->queue_len) {
+        return NULL;
+    }
+    return vq->chain_info + id;
 }
 
 uint32_t virtqueue_scattered_available_size(virtqueue_device_t *vq, virtqueue_ring_object_t *robj)
 {
+    vq_chain_info_t *info = vq_device_chain_info(vq, robj);
     uint32_t ret = 0;
     unsigned cur = robj->first;
 
+    if (info != NULL) {
+        return info->len;
+    }
+    if (vq->features & VQ_F_RING_PACKED) {
+        return vq_packed_scattered_available_size(vq, robj);
+    }
+
     while (cur < vq->queue_len) {
-        ret += vq->desc_table[cur].len;
-        cur = vq->desc_table[cur].next;
+        vq_vring_desc_t *desc = vq->desc_table + cur;
+        if (desc->flags & VQ_DESC_F_INDIRECT) {
+            virtqueue_ring_object_t ind;
+            vq_vring_desc_t *entry;
+            void *table;
+            if (!vq_device_buf(vq, desc, &table)) {
+                break;
+            }
+            vq_enter_indirect(&ind, table, desc->len);
+            while ((entry = vq_next_indirect(&ind)) != NULL) {
+                ret += entry->len;
+            }
+        } else {
+            ret += desc->len;
+        }
+        cur = desc->next;
     }
     return ret;
 }
@@ -190,28 +1057,137 @@ uint32_t virtqueue_scattered_available_size(virtqueue_device_t *vq, virtqueue_ri
 int virtqueue_gather_available(virtqueue_device_t *vq, virtqueue_ring_object_t *robj,
                                void **buf, unsigned *len, vq_flags_t *flag)
 {
-    unsigned idx = robj->cur;
+    vq_vring_desc_t *desc;
 
-    if (idx >= vq->queue_len) {
-        return 0;
+    if (vq->features & VQ_F_RING_PACKED) {
+        return vq_packed_gather_available(vq, robj, buf, len, flag);
     }
 
-    // casting integers to pointers directly is not allowed, must cast the
-    // integer to a uintptr_t first
-    *buf = (void *)(uintptr_t)(vq->desc_table[idx].addr);
+    while ((desc = vq_next_indirect(robj)) == NULL) {
+        if (robj->cur >= vq->queue_len) {
+            return 0;
+        }
+        desc = vq->desc_table + robj->cur;
+        robj->cur = desc->next;
+        if (!(desc->flags & VQ_DESC_F_INDIRECT)) {
+            break;
+        }
+        if (!vq_device_buf(vq, desc, buf)) {
+            return 0;
+        }
+        vq_enter_indirect(robj, *buf, desc->len);
+    }
 
-    *len = vq->desc_table[idx].len;
-    *flag = vq->desc_table[idx].flags;
-    robj->cur = vq->desc_table[idx].next;
+    if (!vq_device_buf(vq, desc, buf)) {
+        return 0;
+    }
+    *len = desc->len;
+    *flag = desc->flags & ~VQ_DESC_F_INDIRECT;
     return 1;
 }
 
+unsigned virtqueue_gather_available_bufs(virtqueue_device_t *vq, virtqueue_ring_object_t *robj,
+                                         vq_buf_t *bufs, unsigned n)
+{
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        if (!virtqueue_gather_available(vq, robj, &bufs[i].buf, &bufs[i].len, &bufs[i].flag)) {
+            break;
+        }
+    }
+    return i;
+}
+
+/* Whether two addresses lie in the same buffer of a pool */
+static inline int vq_pool_same_buf(struct vq_pool *pool, void *a, void *b)
+{
+    return ((char *)a - pool->bufs) / pool->buf_size == ((char *)b - pool->bufs) / pool->buf_size;
+}
+
+#ifndef NDEBUG
+/* Whether an indirect table has an entry, from index cur on, in the same pool buffer as buf */
+static int vq_indirect_uses_buf(virtqueue_driver_t *vq, vq_vring_desc_t *table, unsigned table_len,
+                                unsigned cur, void *buf)
+{
+    void *p;
+    unsigned n;
+
+    /* Bound the walk by the table size, in case the chain loops */
+    for (n = 0; cur < table_len && n < table_len; cur = table[cur].next, n++) {
+        p = virtqueue_driver_buf_ptr(vq, table[cur].addr);
+        if (vq_pool_contains(vq->buf_pool, p) && vq_pool_same_buf(vq->buf_pool, p, buf)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Whether the part of a list not gathered yet uses the same pool buffer as buf */
+static int vq_list_uses_buf(virtqueue_driver_t *vq, virtqueue_ring_object_t *robj, void *buf)
+{
+    vq_vring_desc_t *desc;
+    void *p;
+    unsigned idx, n;
+
+    if (robj->indirect != NULL
+        && vq_indirect_uses_buf(vq, robj->indirect, robj->indirect_len, robj->indirect_cur, buf)) {
+        return 1;
+    }
+    for (idx = robj->cur, n = 0; idx < vq->queue_len && n < vq->queue_len; idx = desc->next, n++) {
+        desc = vq->desc_table + idx;
+        p = virtqueue_driver_buf_ptr(vq, desc->addr);
+        if (desc->flags & VQ_DESC_F_INDIRECT) {
+            if (vq_indirect_uses_buf(vq, p, desc->len / sizeof(vq_vring_desc_t), 0, buf)) {
+                return 1;
+            }
+        } else if (vq_pool_contains(vq->buf_pool, p) && vq_pool_same_buf(vq->buf_pool, p, buf)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+#endif
+
 int virtqueue_gather_used(virtqueue_driver_t *vq, virtqueue_ring_object_t *robj,
                           void **buf, unsigned *len, vq_flags_t *flag)
 {
-    if (robj->cur >= vq->queue_len) {
-        return 0;
+    vq_vring_desc_t *desc;
+    void *recycle = robj->recycle;
+
+    /* The previous buffer is only given back once we know the next one doesn't share its pool
+     * buffer, e.g. a header and a payload in the same buffer */
+    robj->recycle = NULL;
+    while ((desc = vq_next_indirect(robj)) == NULL) {
+        if (robj->cur >= vq->queue_len) {
+            if (recycle != NULL) {
+                vq_pool_free(vq->buf_pool, recycle);
+            }
+            return 0;
+        }
+        robj->cur = vq_pop_desc(vq, robj->cur, buf, len, flag);
+        if (!(*flag & VQ_DESC_F_INDIRECT)) {
+            break;
+        }
+        /* The table stays valid after its descriptor is freed, as the caller owns it */
+        vq_enter_indirect(robj, *buf, *len);
+    }
+
+    if (desc != NULL) {
+        *buf = virtqueue_driver_buf_ptr(vq, desc->addr);
+        *len = desc->len;
+        *flag = desc->flags & ~VQ_DESC_F_INDIRECT;
+    }
+    if (vq->buf_pool != NULL && vq_pool_contains(vq->buf_pool, *buf)) {
+        if (recycle != NULL && vq_pool_same_buf(vq->buf_pool, recycle, *buf)) {
+            recycle = NULL;
+        }
+        robj->recycle = *buf;
+    }
+    if (recycle != NULL) {
+        /* Freeing it now would free it again when the later buffer is gathered */
+        assert(!vq_list_uses_buf(vq, robj, recycle));
+        vq_pool_free(vq->buf_pool, recycle);
     }
-    robj->cur = vq_pop_desc(vq, robj->cur, buf, len, flag);
     return 1;
 }
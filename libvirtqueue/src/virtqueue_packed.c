@@ -0,0 +1,486 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/* Packed ring format. The driver and the device share a single ring of descriptors. The driver
+ * makes chains of buffers available in ring order, and the device returns each chain by
+ * overwriting the ring, in completion order, with one used entry carrying the id of the chain.
+ * Both sides advance by the number of entries in the chain.
+ *
+ * As used entries overwrite the ring from the oldest entry the device has taken, the device keeps
+ * a third position, p_done, below which it has finished reading every chain, and never writes a
+ * used entry past it. Chains can be finished in any order, so the device marks the head of each
+ * chain it finishes with VQ_PACKED_DESC_F_DONE and p_done moves over the marked chains at the
+ * front. The driver never looks at the mark, as it only reads an entry once the device has
+ * written a used entry over it.
+ *
+ * Each side tracks its position as a free-running 16 bit count of ring entries. As queue_len is a
+ * power of 2, the ring entry is the count modulo queue_len and the wrap counter, which starts at
+ * 1 and flips every lap, is the parity of the lap number. */
+
+#include <utils/util.h>
+#include <utils/fence.h>
+
+#include "virtqueue_packed.h"
+
+/* The flag of the buffer is stored above the AVAIL bit */
+#define VQ_PACKED_FLAG_SHIFT 8
+#define VQ_PACKED_FLAG_MASK  0x3
+
+#define VQ_PACKED_WRAP_SHIFT 15
+
+/* Set by the device in the head entry of a chain it has taken and finished reading */
+#define VQ_PACKED_DESC_F_DONE (1u << 14)
+
+static inline unsigned vq_packed_wrap(unsigned queue_len, uint16_t pos)
+{
+    return !((pos / queue_len) & 1);
+}
+
+/* Flags that make the entry at pos available to the device */
+static inline uint16_t vq_packed_avail_flags(unsigned queue_len, uint16_t pos)
+{
+    return vq_packed_wrap(queue_len, pos) ? VQ_PACKED_DESC_F_AVAIL : VQ_PACKED_DESC_F_USED;
+}
+
+/* Flags that return the entry at pos to the driver */
+static inline uint16_t vq_packed_used_flags(unsigned queue_len, uint16_t pos)
+{
+    return vq_packed_wrap(queue_len, pos) ? VQ_PACKED_DESC_F_AVAIL | VQ_PACKED_DESC_F_USED : 0;
+}
+
+static inline uint16_t vq_packed_load_flags(vq_packed_desc_t *desc)
+{
+    return *(volatile uint16_t *)&desc->flags;
+}
+
+static inline void vq_packed_store_flags(vq_packed_desc_t *desc, uint16_t flags)
+{
+    *(volatile uint16_t *)&desc->flags = flags;
+}
+
+static inline int vq_packed_is_avail(unsigned queue_len, uint16_t flags, uint16_t pos)
+{
+    uint16_t mask = VQ_PACKED_DESC_F_AVAIL | VQ_PACKED_DESC_F_USED;
+    return (flags & mask) == vq_packed_avail_flags(queue_len, pos);
+}
+
+static inline int vq_packed_is_used(unsigned queue_len, uint16_t flags, uint16_t pos)
+{
+    uint16_t mask = VQ_PACKED_DESC_F_AVAIL | VQ_PACKED_DESC_F_USED;
+    return (flags & mask) == vq_packed_used_flags(queue_len, pos);
+}
+
+static inline uint16_t vq_packed_off_wrap(unsigned queue_len, uint16_t pos)
+{
+    return (pos & (queue_len - 1)) | (vq_packed_wrap(queue_len, pos) << VQ_PACKED_WRAP_SHIFT);
+}
+
+/* Whether moving from old to new_pos has passed the entry described by off_wrap. The peer sets
+ * off_wrap to its own position, which is at most a lap behind us, so it is resolved to the
+ * matching position in the two laps up to new_pos. */
+static int vq_packed_need_event(unsigned queue_len, uint16_t off_wrap, uint16_t new_pos, uint16_t old)
+{
+    uint16_t laps = 2 * queue_len;
+    uint16_t event = new_pos - (new_pos & (laps - 1)) + (off_wrap & ~(1u << VQ_PACKED_WRAP_SHIFT));
+
+    if (!(off_wrap >> VQ_PACKED_WRAP_SHIFT)) {
+        event += queue_len;
+    }
+    if ((int16_t)(event - new_pos) > 0) {
+        event -= laps;
+    }
+    return (uint16_t)(new_pos - event - 1) < (uint16_t)(new_pos - old);
+}
+
+void vq_packed_init_driver(virtqueue_driver_t *vq)
+{
+    unsigned i;
+
+    for (i = 0; i < vq->queue_len; i++) {
+        vq->packed_ring[i].addr = 0;
+        vq->packed_ring[i].len = 0;
+        vq->packed_ring[i].id = 0;
+        vq->packed_ring[i].flags = 0;
+    }
+    vq->driver_event->off_wrap = 0;
+    vq->driver_event->flags = VQ_PACKED_EVENT_F_ENABLE;
+    vq->device_event->off_wrap = 0;
+    vq->device_event->flags = VQ_PACKED_EVENT_F_ENABLE;
+}
+
+/* Write a chain to the ring, except for the flags of its head entry which make the whole chain
+ * visible to the device. Returns the head entry, or NULL if the ring is full. */
+static vq_packed_desc_t *vq_packed_write_chain(virtqueue_driver_t *vq, const vq_buf_t *bufs, unsigned n,
+                                               uint16_t *head_flags)
+{
+    unsigned mask = vq->queue_len - 1;
+    unsigned id = vq->queue_len;
+    unsigned prev = vq->queue_len;
+    unsigned i;
+
+    /* The driver's descriptor table remembers the buffers, as the device overwrites the ring */
+    for (i = 0; i < n; i++) {
+        unsigned idx = vq_add_desc(vq, bufs[i].buf, bufs[i].len, bufs[i].flag, prev);
+        if (idx == vq->queue_len) {
+            void *buf;
+            unsigned len;
+            vq_flags_t flag;
+            while (id < vq->queue_len) {
+                id = vq_pop_desc(vq, id, &buf, &len, &flag);
+            }
+            return NULL;
+        }
+        if (id == vq->queue_len) {
+            id = idx;
+        }
+        prev = idx;
+    }
+    vq_set_chain_info(vq, id, bufs, n);
+
+    for (i = 0; i < n; i++) {
+        uint16_t pos = vq->p_avail + i;
+        vq_packed_desc_t *desc = vq->packed_ring + (pos & mask);
+        uint16_t flags = vq_packed_avail_flags(vq->queue_len, pos) |
+                         ((bufs[i].flag & VQ_PACKED_FLAG_MASK) << VQ_PACKED_FLAG_SHIFT);
+
+        if (i + 1 < n) {
+            flags |= VQ_PACKED_DESC_F_NEXT;
+        }
+        desc->addr = virtqueue_driver_buf_addr(vq, bufs[i].buf);
+        desc->len = bufs[i].len;
+        desc->id = id;
+        if (i == 0) {
+            *head_flags = flags;
+        } else {
+            vq_packed_store_flags(desc, flags);
+        }
+    }
+    vq->p_avail += n;
+    return vq->packed_ring + ((vq->p_avail - n) & mask);
+}
+
+int vq_packed_add_available_buf(virtqueue_driver_t *vq, virtqueue_ring_object_t *obj,
+                                void *buf, unsigned len, vq_flags_t flag)
+{
+    vq_buf_t b = { .buf = buf, .len = len, .flag = flag };
+    vq_packed_desc_t *head;
+    uint16_t flags;
+
+    if (obj->first < vq->queue_len) {
+        ZF_LOGE("Can't chain buffers in a packed ring, use virtqueue_add_available_chain");
+        return 0;
+    }
+    head = vq_packed_write_chain(vq, &b, 1, &flags);
+    if (head == NULL) {
+        return 0;
+    }
+    obj->first = head->id;
+    obj->cur = obj->first;
+    THREAD_MEMORY_RELEASE();
+    vq_packed_store_flags(head, flags);
+    return 1;
+}
+
+unsigned vq_packed_add_available_bufs(virtqueue_driver_t *vq, const vq_buf_t *bufs, unsigned n)
+{
+    vq_packed_desc_t *head = NULL;
+    uint16_t head_flags = 0;
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        uint16_t flags;
+        vq_packed_desc_t *desc = vq_packed_write_chain(vq, bufs + i, 1, &flags);
+        if (desc == NULL) {
+            break;
+        }
+        /* Make all of the batch visible at once through the flags of the first entry */
+        if (head == NULL) {
+            head = desc;
+            head_flags = flags;
+        } else {
+            vq_packed_store_flags(desc, flags);
+        }
+    }
+
+    if (head != NULL) {
+        THREAD_MEMORY_RELEASE();
+        vq_packed_store_flags(head, head_flags);
+    }
+    return i;
+}
+
+int vq_packed_add_available_chain(virtqueue_driver_t *vq, const vq_buf_t *bufs, unsigned n)
+{
+    uint16_t flags;
+    vq_packed_desc_t *head = vq_packed_write_chain(vq, bufs, n, &flags);
+
+    if (head == NULL) {
+        return 0;
+    }
+    THREAD_MEMORY_RELEASE();
+    vq_packed_store_flags(head, flags);
+    return 1;
+}
+
+unsigned vq_packed_get_used_bufs(virtqueue_driver_t *vq, virtqueue_ring_object_t *robjs, uint32_t *lens,
+                                 unsigned n)
+{
+    unsigned mask = vq->queue_len - 1;
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        vq_packed_desc_t *desc = vq->packed_ring + (vq->p_used & mask);
+        unsigned cur;
+        unsigned count = 0;
+
+        if (!vq_packed_is_used(vq->queue_len, vq_packed_load_flags(desc), vq->p_used)) {
+            break;
+        }
+        /* Don't read the entry before we have seen the flags that publish it */
+        THREAD_MEMORY_ACQUIRE();
+        if (desc->id >= vq->queue_len) {
+            ZF_LOGE("Invalid id in used ring: %d", desc->id);
+            break;
+        }
+        robjs[i].first = desc->id;
+        robjs[i].cur = robjs[i].first;
+        robjs[i].indirect = NULL;
+        robjs[i].recycle = NULL;
+        lens[i] = desc->len;
+
+        /* The device skips over as many entries as the chain took up */
+        for (cur = desc->id; cur < vq->queue_len; cur = vq->desc_table[cur].next) {
+            count++;
+        }
+        vq->p_used += count;
+    }
+    return i;
+}
+
+int vq_packed_driver_poll(virtqueue_driver_t *vq)
+{
+    vq_packed_desc_t *desc = vq->packed_ring + (vq->p_used & (vq->queue_len - 1));
+
+    return vq_packed_is_used(vq->queue_len, vq_packed_load_flags(desc), vq->p_used);
+}
+
+int vq_packed_driver_should_notify(virtqueue_driver_t *vq)
+{
+    uint16_t old = vq->a_ring_notified;
+    uint16_t new_pos = vq->p_avail;
+    int notify;
+
+    /* Our ring updates must be visible before we look at whether the device is waiting */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    switch (vq->device_event->flags) {
+    case VQ_PACKED_EVENT_F_DISABLE:
+        notify = 0;
+        break;
+    case VQ_PACKED_EVENT_F_DESC:
+        notify = vq_packed_need_event(vq->queue_len, vq->device_event->off_wrap, new_pos, old);
+        break;
+    default:
+        notify = 1;
+        break;
+    }
+    vq->a_ring_notified = new_pos;
+    return notify;
+}
+
+int vq_packed_driver_enable_notify(virtqueue_driver_t *vq)
+{
+    if (vq->features & VQ_F_EVENT_IDX) {
+        vq->driver_event->off_wrap = vq_packed_off_wrap(vq->queue_len, vq->p_used);
+        vq->driver_event->flags = VQ_PACKED_EVENT_F_DESC;
+    } else {
+        vq->driver_event->flags = VQ_PACKED_EVENT_F_ENABLE;
+    }
+    /* Publish the request before checking for buffers the device used in the meantime */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return vq_packed_driver_poll(vq);
+}
+
+void vq_packed_driver_disable_notify(virtqueue_driver_t *vq)
+{
+    vq->driver_event->flags = VQ_PACKED_EVENT_F_DISABLE;
+}
+
+/* Note that the device has finished reading the chain of robj, and move p_done over the finished
+ * chains at the front of the entries taken from the ring */
+static void vq_packed_device_done(virtqueue_device_t *vq, virtqueue_ring_object_t *robj)
+{
+    unsigned mask = vq->queue_len - 1;
+    vq_packed_desc_t *desc = vq->packed_ring + (robj->first & mask);
+
+    /* A chain p_done has already moved past may have been overwritten since */
+    if (((robj->first - vq->p_done) & mask) < (uint16_t)(vq->p_avail - vq->p_done)) {
+        vq_packed_store_flags(desc, vq_packed_load_flags(desc) | VQ_PACKED_DESC_F_DONE);
+    }
+
+    while (vq->p_done != vq->p_avail) {
+        uint16_t flags;
+
+        desc = vq->packed_ring + (vq->p_done & mask);
+        if (!(desc->flags & VQ_PACKED_DESC_F_DONE)) {
+            break;
+        }
+        do {
+            flags = vq->packed_ring[vq->p_done & mask].flags;
+            vq->p_done++;
+        } while (flags & VQ_PACKED_DESC_F_NEXT);
+    }
+}
+
+unsigned vq_packed_add_used_bufs(virtqueue_device_t *vq, virtqueue_ring_object_t *robjs, const uint32_t *lens,
+                                 unsigned n)
+{
+    unsigned mask = vq->queue_len - 1;
+    vq_packed_desc_t *head = NULL;
+    uint16_t head_flags = 0;
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        vq_packed_desc_t *desc = vq->packed_ring + (vq->p_used & mask);
+        uint16_t flags = vq_packed_used_flags(vq->queue_len, vq->p_used);
+
+        vq_packed_device_done(vq, &robjs[i]);
+        if ((uint16_t)(vq->p_done - vq->p_used) < robjs[i].count) {
+            ZF_LOGE("Used entry would overwrite a chain that hasn't been gathered");
+            break;
+        }
+
+        desc->id = robjs[i].id;
+        desc->len = lens[i];
+        /* Return all of the batch at once through the flags of the first entry */
+        if (head == NULL) {
+            head = desc;
+            head_flags = flags;
+        } else {
+            vq_packed_store_flags(desc, flags);
+        }
+        vq->p_used += robjs[i].count;
+    }
+
+    if (head != NULL) {
+        THREAD_MEMORY_RELEASE();
+        vq_packed_store_flags(head, head_flags);
+    }
+    return i;
+}
+
+unsigned vq_packed_get_available_bufs(virtqueue_device_t *vq, virtqueue_ring_object_t *robjs, unsigned n)
+{
+    unsigned mask = vq->queue_len - 1;
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        vq_packed_desc_t *desc = vq->packed_ring + (vq->p_avail & mask);
+        unsigned count = 1;
+
+        if (!vq_packed_is_avail(vq->queue_len, vq_packed_load_flags(desc), vq->p_avail)) {
+            break;
+        }
+        /* Don't read the chain before we have seen the flags that publish it */
+        THREAD_MEMORY_ACQUIRE();
+        robjs[i].first = vq->p_avail & mask;
+        robjs[i].cur = robjs[i].first;
+        robjs[i].indirect = NULL;
+        robjs[i].id = desc->id;
+        while (desc->flags & VQ_PACKED_DESC_F_NEXT) {
+            desc = vq->packed_ring + ((vq->p_avail + count) & mask);
+            count++;
+        }
+        robjs[i].count = count;
+        vq->p_avail += count;
+    }
+    return i;
+}
+
+int vq_packed_device_poll(virtqueue_device_t *vq)
+{
+    vq_packed_desc_t *desc = vq->packed_ring + (vq->p_avail & (vq->queue_len - 1));
+
+    return vq_packed_is_avail(vq->queue_len, vq_packed_load_flags(desc), vq->p_avail);
+}
+
+int vq_packed_device_should_notify(virtqueue_device_t *vq)
+{
+    uint16_t old = vq->u_ring_notified;
+    uint16_t new_pos = vq->p_used;
+    int notify;
+
+    /* Our ring updates must be visible before we look at whether the driver is waiting */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    switch (vq->driver_event->flags) {
+    case VQ_PACKED_EVENT_F_DISABLE:
+        notify = 0;
+        break;
+    case VQ_PACKED_EVENT_F_DESC:
+        notify = vq_packed_need_event(vq->queue_len, vq->driver_event->off_wrap, new_pos, old);
+        break;
+    default:
+        notify = 1;
+        break;
+    }
+    vq->u_ring_notified = new_pos;
+    return notify;
+}
+
+int vq_packed_device_enable_notify(virtqueue_device_t *vq)
+{
+    if (vq->features & VQ_F_EVENT_IDX) {
+        vq->device_event->off_wrap = vq_packed_off_wrap(vq->queue_len, vq->p_avail);
+        vq->device_event->flags = VQ_PACKED_EVENT_F_DESC;
+    } else {
+        vq->device_event->flags = VQ_PACKED_EVENT_F_ENABLE;
+    }
+    /* Publish the request before checking for buffers the driver added in the meantime */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return vq_packed_device_poll(vq);
+}
+
+void vq_packed_device_disable_notify(virtqueue_device_t *vq)
+{
+    vq->device_event->flags = VQ_PACKED_EVENT_F_DISABLE;
+}
+
+uint32_t vq_packed_scattered_available_size(virtqueue_device_t *vq, virtqueue_ring_object_t *robj)
+{
+    unsigned mask = vq->queue_len - 1;
+    uint32_t ret = 0;
+    unsigned i;
+
+    for (i = 0; i < robj->count; i++) {
+        ret += vq->packed_ring[(robj->first + i) & mask].len;
+    }
+    return ret;
+}
+
+int vq_packed_gather_available(virtqueue_device_t *vq, virtqueue_ring_object_t *robj,
+                               void **buf, unsigned *len, vq_flags_t *flag)
+{
+    vq_packed_desc_t *desc;
+
+    if (robj->cur >= vq->queue_len) {
+        return 0;
+    }
+    desc = vq->packed_ring + robj->cur;
+
+    *buf = virtqueue_device_buf_ptr(vq, desc->addr, desc->len);
+    if (*buf == NULL && vq->pool_size != 0) {
+        ZF_LOGE("Buffer at %llx is outside of the pool", (unsigned long long)desc->addr);
+        return 0;
+    }
+    *len = desc->len;
+    *flag = (desc->flags >> VQ_PACKED_FLAG_SHIFT) & VQ_PACKED_FLAG_MASK;
+    if (desc->flags & VQ_PACKED_DESC_F_NEXT) {
+        robj->cur = (robj->cur + 1) & (vq->queue_len - 1);
+    } else {
+        robj->cur = vq->queue_len;
+        vq_packed_device_done(vq, robj);
+    }
+    return 1;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <virtqueue.h>
+
+/* Descriptor table free list, shared by both ring formats on the driver side */
+unsigned vq_add_desc(virtqueue_driver_t *vq, void *buf, unsigned len, vq_flags_t flag, unsigned prev);
+unsigned vq_pop_desc(virtqueue_driver_t *vq, unsigned idx, void **buf, unsigned *len, vq_flags_t *flag);
+
+/* Record the summary of a list that starts at head and is about to be made available */
+static inline void vq_set_chain_info(virtqueue_driver_t *vq, unsigned head, const vq_buf_t *bufs, unsigned n)
+{
+    uint32_t len = 0;
+    unsigned i;
+
+    if (vq->chain_info == NULL) {
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        len += bufs[i].len;
+    }
+    vq->chain_info[head].len = len;
+    vq->chain_info[head].count = n;
+}
+
+/* Packed ring implementations of the public functions, which call these when the queue was
+ * initialised with VQ_F_RING_PACKED */
+void vq_packed_init_driver(virtqueue_driver_t *vq);
+
+int vq_packed_add_available_buf(virtqueue_driver_t *vq, virtqueue_ring_object_t *obj,
+                                void *buf, unsigned len, vq_flags_t flag);
+unsigned vq_packed_add_available_bufs(virtqueue_driver_t *vq, const vq_buf_t *bufs, unsigned n);
+int vq_packed_add_available_chain(virtqueue_driver_t *vq, const vq_buf_t *bufs, unsigned n);
+unsigned vq_packed_get_used_bufs(virtqueue_driver_t *vq, virtqueue_ring_object_t *robjs, uint32_t *lens,
+                                 unsigned n);
+int vq_packed_driver_poll(virtqueue_driver_t *vq);
+int vq_packed_driver_should_notify(virtqueue_driver_t *vq);
+int vq_packed_driver_enable_notify(virtqueue_driver_t *vq);
+void vq_packed_driver_disable_notify(virtqueue_driver_t *vq);
+
+unsigned vq_packed_add_used_bufs(virtqueue_device_t *vq, virtqueue_ring_object_t *robjs, const uint32_t *lens,
+                                 unsigned n);
+unsigned vq_packed_get_available_bufs(virtqueue_device_t *vq, virtqueue_ring_object_t *robjs, unsigned n);
+int vq_packed_device_poll(virtqueue_device_t *vq);
+int vq_packed_device_should_notify(virtqueue_device_t *vq);
+int vq_packed_device_enable_notify(virtqueue_device_t *vq);
+void vq_packed_device_disable_notify(virtqueue_device_t *vq);
+
+uint32_t vq_packed_scattered_available_size(virtqueue_device_t *vq, virtqueue_ring_object_t *robj);
+int vq_packed_gather_available(virtqueue_device_t *vq, virtqueue_ring_object_t *robj,
+                               void **buf, unsigned *len, vq_flags_t *flag);
@@ -0,0 +1,96 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/* The free list is a stack linked through the first word of each free buffer, holding the index +
+ * 1 of the next free buffer (0 ends the list). Links are indices rather than pointers so that they
+ * mean the same in every mapping of the pool. The head carries a generation count in its upper
+ * half that changes on every pop, so a compare-and-swap can't succeed on a stale head (ABA). */
+
+#include <utils/util.h>
+#include <virtqueue.h>
+#include <virtqueue_pool.h>
+
+#define VQ_POOL_INDEX(head) ((uint32_t)(head))
+#define VQ_POOL_GEN(head) ((uint32_t)((head) >> 32))
+#define VQ_POOL_HEAD(gen, index) (((uint64_t)(gen) << 32) | (index))
+
+static inline uint32_t *vq_pool_link(vq_pool_t *pool, uint32_t index)
+{
+    return (uint32_t *)(void *)(pool->bufs + (size_t)(index - 1) * pool->buf_size);
+}
+
+int vq_pool_attach(vq_pool_t *pool, void *mem, size_t size, size_t buf_size)
+{
+    buf_size = ROUND_UP(buf_size, sizeof(uint64_t));
+    if (buf_size == 0 || size < VQ_CACHE_LINE + buf_size) {
+        ZF_LOGE("Pool of %zu bytes is too small for buffers of %zu bytes", size, buf_size);
+        return -1;
+    }
+    pool->head = mem;
+    pool->bufs = (char *)mem + VQ_CACHE_LINE;
+    pool->buf_size = buf_size;
+    pool->count = MIN((size - VQ_CACHE_LINE) / buf_size, UINT32_MAX - 1);
+    return 0;
+}
+
+int vq_pool_init(vq_pool_t *pool, void *mem, size_t size, size_t buf_size)
+{
+    uint32_t i;
+
+    if (vq_pool_attach(pool, mem, size, buf_size)) {
+        return -1;
+    }
+    for (i = 1; i < pool->count; i++) {
+        *vq_pool_link(pool, i) = i + 1;
+    }
+    *vq_pool_link(pool, pool->count) = 0;
+    __atomic_store_n(pool->head, VQ_POOL_HEAD(0, 1), __ATOMIC_RELEASE);
+    return 0;
+}
+
+void *vq_pool_alloc(vq_pool_t *pool)
+{
+    uint64_t old = __atomic_load_n(pool->head, __ATOMIC_ACQUIRE);
+    uint64_t new_head;
+
+    do {
+        uint32_t index = VQ_POOL_INDEX(old);
+        if (index == 0) {
+            return NULL;
+        }
+        /* The buffer may be taken and overwritten under our feet, in which case the generation
+         * has moved on and the exchange below fails */
+        new_head = VQ_POOL_HEAD(VQ_POOL_GEN(old) + 1,
+                                __atomic_load_n(vq_pool_link(pool, index), __ATOMIC_RELAXED));
+    } while (!__atomic_compare_exchange_n(pool->head, &old, new_head, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    return vq_pool_link(pool, VQ_POOL_INDEX(old));
+}
+
+void vq_pool_free(vq_pool_t *pool, void *buf)
+{
+    uint64_t old;
+    uint32_t index;
+
+    if (!vq_pool_contains(pool, buf)) {
+        ZF_LOGE("Freeing %p which is not in the pool", buf);
+        return;
+    }
+    index = ((char *)buf - pool->bufs) / pool->buf_size + 1;
+
+    old = __atomic_load_n(pool->head, __ATOMIC_RELAXED);
+    do {
+        __atomic_store_n(vq_pool_link(pool, index), VQ_POOL_INDEX(old), __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(pool->head, &old, VQ_POOL_HEAD(VQ_POOL_GEN(old), index), 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+int vq_pool_contains(vq_pool_t *pool, void *buf)
+{
+    char *p = buf;
+
+    return p >= pool->bufs && (size_t)(p - pool->bufs) < (size_t)pool->count * pool->buf_size;
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <utils/util.h>
+#include <virtqueue.h>
+
+#include "virtqueue_stats.h"
+
+#ifdef CONFIG_LIB_VIRTQUEUE_STATS
+
+void vq_stats_init(vq_stats_t *stats)
+{
+    stats->clock = NULL;
+    stats->sample_period = VQ_STATS_SAMPLE_PERIOD;
+    virtqueue_stats_reset(stats);
+}
+
+vq_stats_t *virtqueue_driver_stats(virtqueue_driver_t *vq)
+{
+    return &vq->stats;
+}
+
+vq_stats_t *virtqueue_device_stats(virtqueue_device_t *vq)
+{
+    return &vq->stats;
+}
+
+#else
+
+vq_stats_t *virtqueue_driver_stats(UNUSED virtqueue_driver_t *vq)
+{
+    return NULL;
+}
+
+vq_stats_t *virtqueue_device_stats(UNUSED virtqueue_device_t *vq)
+{
+    return NULL;
+}
+
+#endif
+
+void virtqueue_stats_set_clock(vq_stats_t *stats, uint64_t (*clock)(void), unsigned period)
+{
+    if (stats == NULL) {
+        return;
+    }
+    stats->clock = clock;
+    stats->sample_period = period ? period : VQ_STATS_SAMPLE_PERIOD;
+    stats->sample_wait = 0;
+    stats->sample_id = VQ_STATS_NO_SAMPLE;
+}
+
+void virtqueue_stats_reset(vq_stats_t *stats)
+{
+    if (stats == NULL) {
+        return;
+    }
+    stats->enqueued = 0;
+    stats->dequeued = 0;
+    stats->full = 0;
+    stats->empty_polls = 0;
+    stats->notify_sent = 0;
+    stats->notify_suppressed = 0;
+    memset(stats->batch_hist, 0, sizeof(stats->batch_hist));
+    memset(stats->latency_hist, 0, sizeof(stats->latency_hist));
+    stats->sample_wait = 0;
+    stats->sample_id = VQ_STATS_NO_SAMPLE;
+}
+
+static void vq_stats_dump_hist(const char *what, const uint64_t *hist, unsigned buckets)
+{
+    unsigned i;
+
+    printf("  %s:", what);
+    for (i = 0; i < buckets; i++) {
+        if (hist[i] != 0) {
+            printf(" [%" PRIu64 "%s] %" PRIu64, (uint64_t)1 << i, i == buckets - 1 ? "+" : "", hist[i]);
+        }
+    }
+    printf("\n");
+}
+
+void virtqueue_stats_dump(vq_stats_t *stats, const char *name)
+{
+    if (stats == NULL) {
+        printf("%s: statistics not enabled (CONFIG_LIB_VIRTQUEUE_STATS)\n", name);
+        return;
+    }
+    printf("%s: enqueued %" PRIu64 " dequeued %" PRIu64 " full %" PRIu64 " empty polls %" PRIu64 "\n",
+           name, stats->enqueued, stats->dequeued, stats->full, stats->empty_polls);
+    printf("  notifications: sent %" PRIu64 " suppressed %" PRIu64 "\n",
+           stats->notify_sent, stats->notify_suppressed);
+    vq_stats_dump_hist("batch sizes", stats->batch_hist, VQ_STATS_BATCH_BUCKETS);
+    if (stats->clock != NULL) {
+        vq_stats_dump_hist("latency (ticks)", stats->latency_hist, VQ_STATS_LATENCY_BUCKETS);
+    }
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <utils/util.h>
+#include <virtqueue.h>
+
+/* Hooks called by the ring functions to keep the statistics. They compile to nothing unless the
+ * library is built with CONFIG_LIB_VIRTQUEUE_STATS. */
+
+#define VQ_STATS_NO_SAMPLE ((uint32_t) -1)
+
+#ifdef CONFIG_LIB_VIRTQUEUE_STATS
+
+#define VQ_STATS(vq) (&(vq)->stats)
+
+static inline unsigned vq_stats_bucket(uint64_t val, unsigned buckets)
+{
+    unsigned b = val ? 63 - __builtin_clzll(val) : 0;
+    return MIN(b, buckets - 1);
+}
+
+void vq_stats_init(vq_stats_t *stats);
+
+/* n of the wanted buffer lists were added to the ring */
+static inline void vq_stats_add(vq_stats_t *stats, unsigned n, unsigned wanted)
+{
+    stats->enqueued += n;
+    if (n < wanted) {
+        stats->full++;
+    }
+}
+
+/* n buffer lists were taken from the ring */
+static inline void vq_stats_get(vq_stats_t *stats, unsigned n)
+{
+    if (n == 0) {
+        stats->empty_polls++;
+        return;
+    }
+    stats->dequeued += n;
+    stats->batch_hist[vq_stats_bucket(n, VQ_STATS_BATCH_BUCKETS)]++;
+}
+
+static inline void vq_stats_notify(vq_stats_t *stats, int notify)
+{
+    if (notify) {
+        stats->notify_sent++;
+    } else {
+        stats->notify_suppressed++;
+    }
+}
+
+/* n buffer lists starting with id went past; start timing id if a sample is due */
+static inline void vq_stats_sample_start(vq_stats_t *stats, unsigned n, uint32_t id)
+{
+    if (n == 0 || stats->clock == NULL || stats->sample_id != VQ_STATS_NO_SAMPLE) {
+        return;
+    }
+    if (stats->sample_wait > n) {
+        stats->sample_wait -= n;
+        return;
+    }
+    stats->sample_wait = stats->sample_period;
+    stats->sample_id = id;
+    stats->sample_start = stats->clock();
+}
+
+/* n buffer lists came back; stop timing if the one being timed is among them */
+static inline void vq_stats_sample_end(vq_stats_t *stats, virtqueue_ring_object_t *robjs, unsigned n)
+{
+    unsigned i;
+
+    if (stats->sample_id == VQ_STATS_NO_SAMPLE) {
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        if (robjs[i].first == stats->sample_id) {
+            uint64_t latency = stats->clock() - stats->sample_start;
+            stats->latency_hist[vq_stats_bucket(latency, VQ_STATS_LATENCY_BUCKETS)]++;
+            stats->sample_id = VQ_STATS_NO_SAMPLE;
+            return;
+        }
+    }
+}
+
+/* The count descriptors from first on came back at once; stop timing if the one being timed is
+ * among them */
+static inline void vq_stats_sample_end_range(vq_stats_t *stats, uint32_t first, unsigned count,
+                                             unsigned mask)
+{
+    if (stats->sample_id == VQ_STATS_NO_SAMPLE) {
+        return;
+    }
+    if (count > mask || ((stats->sample_id - first) & mask) < count) {
+        uint64_t latency = stats->clock() - stats->sample_start;
+        stats->latency_hist[vq_stats_bucket(latency, VQ_STATS_LATENCY_BUCKETS)]++;
+        stats->sample_id = VQ_STATS_NO_SAMPLE;
+    }
+}
+
+#else
+
+#define VQ_STATS(vq) ((vq_stats_t *)NULL)
+
+static inline void vq_stats_init(UNUSED vq_stats_t *stats) {}
+static inline void vq_stats_add(UNUSED vq_stats_t *stats, UNUSED unsigned n, UNUSED unsigned wanted) {}
+static inline void vq_stats_get(UNUSED vq_stats_t *stats, UNUSED unsigned n) {}
+static inline void vq_stats_notify(UNUSED vq_stats_t *stats, UNUSED int notify) {}
+static inline void vq_stats_sample_start(UNUSED vq_stats_t *stats, UNUSED unsigned n, UNUSED uint32_t id) {}
+static inline void vq_stats_sample_end(UNUSED vq_stats_t *stats, UNUSED virtqueue_ring_object_t *robjs,
+                                       UNUSED unsigned n) {}
+static inline void vq_stats_sample_end_range(UNUSED vq_stats_t *stats, UNUSED uint32_t first,
+                                             UNUSED unsigned count, UNUSED unsigned mask) {}
+
+#endif
@@ -0,0 +1,283 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/* Host tests for libvirtqueue.
+ *
+ * The driver and device halves of each virtqueue run in the same thread.
+ * Where one side waits, its wait function plays the other side, so a
+ * blocked consumer is woken by the buffers the wait function adds.
+ * Failed checks are reported on stderr and make the exit status non-zero.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <virtqueue.h>
+#include <virtqueue_pool.h>
+
+#define QUEUE_LEN           16
+#define SPIN_MAX            64
+/* Rounds of a steady load, long enough for a budget to settle */
+#define BUSY_ROUNDS         1000
+#define POOL_BUFS           4
+#define POOL_BUF_SIZE       64
+
+static unsigned failures;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+typedef struct test_vq {
+    void *ring;
+    virtqueue_driver_t drv;
+    virtqueue_device_t dev;
+    char buf[64];
+    unsigned waits;     /* Calls to the wait function */
+} test_vq_t;
+
+static void test_vq_init(test_vq_t *t)
+{
+    vq_layout_t layout;
+
+    memset(t, 0, sizeof(*t));
+    CHECK(virtqueue_layout(&layout, QUEUE_LEN, 0, 0) == 0);
+    if (posix_memalign(&t->ring, VQ_CACHE_LINE, layout.size) != 0) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memset(t->ring, 0, layout.size);
+    virtqueue_init_driver(&t->drv, QUEUE_LEN, (void *)((char *)t->ring + layout.avail),
+                          (void *)((char *)t->ring + layout.used), (void *)((char *)t->ring + layout.desc),
+                          NULL, NULL);
+    virtqueue_init_device(&t->dev, QUEUE_LEN, (void *)((char *)t->ring + layout.avail),
+                          (void *)((char *)t->ring + layout.used), (void *)((char *)t->ring + layout.desc),
+                          NULL, NULL);
+}
+
+/* The driver makes a buffer available */
+static void drv_add(test_vq_t *t)
+{
+    vq_buf_t buf = { .buf = t->buf, .len = sizeof(t->buf), .flag = VQ_READ };
+
+    CHECK(virtqueue_add_available_bufs(&t->drv, &buf, 1) == 1);
+}
+
+/* The device takes a buffer and gives it back */
+static void dev_complete(test_vq_t *t)
+{
+    virtqueue_ring_object_t robj;
+    uint32_t len = 0;
+
+    CHECK(virtqueue_get_available_bufs(&t->dev, &robj, 1) == 1);
+    CHECK(virtqueue_add_used_bufs(&t->dev, &robj, &len, 1) == 1);
+}
+
+/* The driver takes back a used buffer */
+static void drv_reclaim(test_vq_t *t)
+{
+    virtqueue_ring_object_t robj;
+    uint32_t len;
+    void *buf;
+    unsigned buf_len;
+    vq_flags_t flag;
+
+    CHECK(virtqueue_get_used_bufs(&t->drv, &robj, &len, 1) == 1);
+    while (virtqueue_gather_used(&t->drv, &robj, &buf, &buf_len, &flag));
+}
+
+/* A driver blocked in virtqueue_driver_wait is woken by the device using a buffer */
+static void drv_wait(void *cookie)
+{
+    test_vq_t *t = cookie;
+
+    t->waits++;
+    dev_complete(t);
+}
+
+/* A device blocked in virtqueue_device_wait is woken by the driver adding a buffer */
+static void dev_wait(void *cookie)
+{
+    test_vq_t *t = cookie;
+
+    t->waits++;
+    drv_add(t);
+}
+
+/* An idle driver wears its spin budget down to spin_min, and a busy one
+ * wins it back even from 0
+ */
+static void test_driver_poller_recovers(void)
+{
+    test_vq_t t;
+    vq_poller_t poller;
+
+    test_vq_init(&t);
+    vq_poller_init(&poller, 0, SPIN_MAX, drv_wait, &t);
+
+    /* Each buffer is only used once the driver has blocked */
+    for (unsigned i = 0; i < 10; i++) {
+        drv_add(&t);
+        virtqueue_driver_wait(&t.drv, &poller);
+        drv_reclaim(&t);
+    }
+    CHECK(t.waits == 10);
+    CHECK(poller.spin == 0);
+
+    /* Now each buffer is used before the driver looks */
+    drv_add(&t);
+    dev_complete(&t);
+    virtqueue_driver_wait(&t.drv, &poller);
+    drv_reclaim(&t);
+    CHECK(t.waits == 10);
+    CHECK(poller.spin == 1);
+
+    /* Buffers that are there on the first poll don't inflate the budget */
+    for (unsigned i = 0; i < BUSY_ROUNDS; i++) {
+        drv_add(&t);
+        dev_complete(&t);
+        virtqueue_driver_wait(&t.drv, &poller);
+        drv_reclaim(&t);
+    }
+    CHECK(t.waits == 10);
+    CHECK(poller.spin == 1);
+
+    free(t.ring);
+}
+
+static void test_device_poller_recovers(void)
+{
+    test_vq_t t;
+    vq_poller_t poller;
+
+    test_vq_init(&t);
+    vq_poller_init(&poller, 0, SPIN_MAX, dev_wait, &t);
+
+    for (unsigned i = 0; i < 10; i++) {
+        virtqueue_device_wait(&t.dev, &poller);
+        dev_complete(&t);
+        drv_reclaim(&t);
+    }
+    CHECK(t.waits == 10);
+    CHECK(poller.spin == 0);
+
+    for (unsigned i = 0; i < BUSY_ROUNDS; i++) {
+        drv_add(&t);
+        virtqueue_device_wait(&t.dev, &poller);
+        dev_complete(&t);
+        drv_reclaim(&t);
+    }
+    CHECK(t.waits == 10);
+    CHECK(poller.spin == 1);
+
+    free(t.ring);
+}
+
+/* The budget never drops below spin_min */
+static void test_poller_spin_min(void)
+{
+    test_vq_t t;
+    vq_poller_t poller;
+
+    test_vq_init(&t);
+    vq_poller_init(&poller, 4, SPIN_MAX, drv_wait, &t);
+
+    for (unsigned i = 0; i < 10; i++) {
+        drv_add(&t);
+        virtqueue_driver_wait(&t.drv, &poller);
+        drv_reclaim(&t);
+    }
+    CHECK(poller.spin == 4);
+
+    free(t.ring);
+}
+
+/* Count the buffers left in a pool, taking them all out and putting them back */
+static unsigned pool_free_count(vq_pool_t *pool)
+{
+    void *bufs[POOL_BUFS * 2];
+    unsigned n = 0;
+
+    /* A buffer freed twice is handed out twice, so look past the pool size */
+    while (n < POOL_BUFS * 2 && (bufs[n] = vq_pool_alloc(pool)) != NULL) {
+        for (unsigned i = 0; i < n; i++) {
+            CHECK(bufs[i] != bufs[n]);
+        }
+        n++;
+    }
+    for (unsigned i = 0; i < n; i++) {
+        vq_pool_free(pool, bufs[i]);
+    }
+    return n;
+}
+
+/* A list whose adjacent buffers share pool buffers frees each of them once */
+static void test_buf_pool_shared(int indirect)
+{
+    test_vq_t t;
+    vq_pool_t pool;
+    void *mem;
+    char *a, *b;
+    vq_buf_t bufs[4];
+    vq_vring_desc_t table[4];
+    virtqueue_ring_object_t robj;
+    uint32_t len = 0;
+    void *buf;
+    unsigned buf_len, n = 0;
+    vq_flags_t flag;
+
+    test_vq_init(&t);
+    if (posix_memalign(&mem, VQ_CACHE_LINE, VQ_CACHE_LINE + POOL_BUFS * POOL_BUF_SIZE) != 0) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    CHECK(vq_pool_init(&pool, mem, VQ_CACHE_LINE + POOL_BUFS * POOL_BUF_SIZE, POOL_BUF_SIZE) == 0);
+    virtqueue_driver_set_buf_pool(&t.drv, &pool);
+
+    /* A header and a payload in each of two pool buffers */
+    a = vq_pool_alloc(&pool);
+    b = vq_pool_alloc(&pool);
+    bufs[0] = (vq_buf_t) { .buf = a, .len = 16, .flag = VQ_READ };
+    bufs[1] = (vq_buf_t) { .buf = a + 16, .len = 32, .flag = VQ_READ };
+    bufs[2] = (vq_buf_t) { .buf = b, .len = 16, .flag = VQ_READ };
+    bufs[3] = (vq_buf_t) { .buf = b + 16, .len = 32, .flag = VQ_READ };
+    if (indirect) {
+        virtqueue_init_ring_object(&robj);
+        CHECK(virtqueue_add_available_indirect(&t.drv, &robj, table, bufs, 4) == 1);
+    } else {
+        CHECK(virtqueue_add_available_chain(&t.drv, bufs, 4) == 1);
+    }
+    dev_complete(&t);
+
+    CHECK(virtqueue_get_used_bufs(&t.drv, &robj, &len, 1) == 1);
+    while (virtqueue_gather_used(&t.drv, &robj, &buf, &buf_len, &flag)) {
+        n++;
+    }
+    CHECK(n == 4);
+    CHECK(pool_free_count(&pool) == POOL_BUFS);
+
+    free(mem);
+    free(t.ring);
+}
+
+int main(void)
+{
+    test_driver_poller_recovers();
+    test_device_poller_recovers();
+    test_poller_spin_min();
+    test_buf_pool_shared(0);
+    test_buf_pool_shared(1);
+
+    if (failures != 0) {
+        fprintf(stderr, "%u checks failed\n", failures);
+    }
+    return failures != 0;
+}
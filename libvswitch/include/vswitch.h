@@ -14,11 +14,18 @@
 #include <net/ethernet.h>
 
 #include <virtqueue.h>
+#include <virtqueue_pool.h>
 
-/* TODO: Need to introduce or paramterise this variable into the
- * build system
+/* Number of nodes that vswitch_init makes room for. Use
+ * vswitch_init_with_size for a larger topology.
  */
 #define VSWITCH_NUM_NODES           (4)
+/* Most frames taken from a node's recv_queue in one call to
+ * vswitch_forward_burst
+ */
+#define VSWITCH_MAX_BURST           (32)
+/* Most buffers a forwarded frame can be scattered over */
+#define VSWITCH_MAX_FRAME_SEGS      (16)
 /* MAC address print format*/
 #define PR_MAC802_ADDR                      "%x:%x:%x:%x:%x:%x"
 /* Expects a *pointer* to a struct ether_addr */
@@ -44,7 +51,7 @@ static inline bool mac802_addr_eq_num(struct ether_addr *addr0,
                                       struct ether_addr *addr1, unsigned int num)
 {
     assert(num <= ETH_ALEN);
-    for (int i = 0; i < num; i++) {
+    for (unsigned int i = 0; i < num; i++) {
         if (addr0->ether_addr_octet[i] != addr1->ether_addr_octet[i]) {
             return false;
         }
@@ -68,11 +75,59 @@ static inline bool mac802_addr_eq_ipv6_mcast(struct ether_addr *addr)
     return mac802_addr_eq_num(addr, &ipv6_multicast_macaddr, 2);
 }
 
+/* Broadcast and multicast addresses have the group bit set */
+static inline bool mac802_addr_is_group(struct ether_addr *addr)
+{
+    return addr->ether_addr_octet[0] & 1;
+}
+
+/* Load a MAC address as a single integer, so that two addresses can be
+ * compared with one instruction. The null address loads as 0.
+ */
+static inline uint64_t mac802_addr_to_u64(struct ether_addr *addr)
+{
+    uint64_t key = 0;
+
+    memcpy(&key, addr->ether_addr_octet, ETH_ALEN);
+    return key;
+}
+
+/*
+ * A pool that frames are copied into on their way to one or more nodes.
+ * Nodes given the same pool share one of these, so that a broadcast or
+ * multicast frame is copied into the pool once and the same buffer is
+ * added to the send_queue of each of them. Each buffer has a count of
+ * the send_queues holding it and goes back to the pool when the last of
+ * them is done with it.
+ */
+typedef struct vswitch_tx_pool_ {
+    vq_pool_t *pool;        /* NULL if the entry is unused */
+    uint32_t *refs;         /* Reference count of each buffer of the pool */
+    unsigned users;         /* Number of nodes using the pool */
+    char *frame;            /* Copy of the frame being forwarded, if frame_seq is current */
+    uint64_t frame_seq;
+} vswitch_tx_pool_t;
+
 typedef struct vswitch_node_ {
     struct ether_addr addr;
     vswitch_virtqueues_t virtqueues;
+    vswitch_tx_pool_t *tx_pool; /* Pool that frames sent to the node are copied into */
+    vq_buf_t *tx;           /* Frames waiting for send_queue, VSWITCH_MAX_BURST entries */
+    unsigned n_tx;          /* Number of frames in tx */
+    unsigned in_flight;     /* Frames in send_queue that haven't been reclaimed */
 } vswitch_node_t;
 
+/*
+ * An entry in the forwarding database, which maps the MAC address of
+ * each connected node to its index in the node table. The database is
+ * an open-addressed hash table with linear probing, kept at most half
+ * full so that a lookup usually takes a single compare.
+ */
+typedef struct vswitch_fdb_entry_ {
+    uint64_t key;   /* MAC address from mac802_addr_to_u64, 0 if empty */
+    int node;       /* Index of the node in vswitch_t.nodes */
+} vswitch_fdb_entry_t;
+
 /*
  * Each component participating in a vswitch topology should have a
  * MAC address assigned to them. It is expected during the initialisation of
@@ -85,15 +140,41 @@ typedef struct vswitch_node_ {
  */
 typedef struct vswitch_ {
     int n_connected;
-    vswitch_node_t nodes[VSWITCH_NUM_NODES];
+    size_t num_nodes;               /* Size of the node table */
+    vswitch_node_t *nodes;          /* The node table */
+    size_t fdb_mask;                /* Size of the forwarding database - 1 */
+    unsigned fdb_bits;              /* log2 of the size of the forwarding database */
+    vswitch_fdb_entry_t *fdb;       /* The forwarding database */
+    vq_buf_t *tx_bufs;              /* Backing for the tx arrays of the nodes */
+    vswitch_tx_pool_t *tx_pools;    /* The distinct tx pools, num_nodes + 1 entries */
+    uint64_t frame_seq;             /* Number of the frame being forwarded */
+    int *tx_pending;                /* Indices of the nodes with frames in tx */
+    size_t n_tx_pending;
+    uint64_t forwarded;             /* Frames added to a send_queue */
+    uint64_t dropped;               /* Frames, or copies of a frame, that couldn't be delivered */
 } vswitch_t;
 
-/** Initialize an instance of this library
+/** Initialize an instance of this library with room for
+ * VSWITCH_NUM_NODES nodes.
  * @param lib Uninitialized handle for a prospective instance of this library.
  * @return 0 on success.
  */
 int vswitch_init(vswitch_t *lib);
 
+/** Initialize an instance of this library with room for a given number
+ * of nodes. The node table and forwarding database are allocated with
+ * calloc.
+ * @param lib Uninitialized handle for a prospective instance of this library.
+ * @param num_nodes Maximum number of nodes that can be connected.
+ * @return 0 on success, -1 if allocation fails.
+ */
+int vswitch_init_with_size(vswitch_t *lib, size_t num_nodes);
+
+/** Free the memory allocated by vswitch_init or vswitch_init_with_size.
+ * @param lib Initialized instance of this library.
+ */
+void vswitch_free(vswitch_t *lib);
+
 /** Initializes metadata to track a destination node connected to the VSWITCH
  * bcast domain.
  *
@@ -105,7 +186,8 @@ int vswitch_init(vswitch_t *lib);
  * @param guest_macaddr A pointer to a mac address for the Guest VM being
  *                      registered.
  * @param send_virtqueue An initialized handle to a send virtqueue for
- *                        the destination being registered.
+ *                        the destination being registered, or NULL if
+ *                        frames for it are to be dropped.
  * @param recv_virtqueue An initialized handle to a recieve virtqueue for
  *                        the destination being registered.
  */
@@ -114,8 +196,50 @@ int vswitch_connect(vswitch_t *lib,
                     virtqueue_driver_t *send_virtqueue,
                     virtqueue_device_t *recv_virtqueue);
 
+/** Give the switch a pool of buffers in memory shared with a node, for
+ * the frames it forwards to the node. Frames for a node without a pool
+ * are dropped. The switch frees the buffers itself when the node is done
+ * with them, so the pool must not also be set as the buf_pool of the
+ * node's send_queue. The pool should be set before any frames are
+ * forwarded to the node. Changing it later first reclaims the frames the
+ * node has finished with, and fails while the node still holds frames
+ * from the old pool, as their buffers would otherwise be lost when the
+ * old pool is released.
+ *
+ * Several nodes can be given the same pool if it is mapped by all of
+ * them. A broadcast or multicast frame is then copied once for all of
+ * them rather than once each. Those nodes can read every frame in the
+ * pool, so only nodes that trust each other should share one.
+ *
+ * @param lib Initialized instance of this library.
+ * @param mac Mac address of a connected node.
+ * @param pool The pool, or NULL.
+ * @return 0 on success, -1 if the node isn't connected, still holds
+ *         frames from its current pool, or the reference counts for the
+ *         pool can't be allocated.
+ */
+int vswitch_set_tx_pool(vswitch_t *lib, struct ether_addr *mac, vq_pool_t *pool);
+
+/** Forward frames between the connected nodes. For each node, up to
+ * "burst" frames are taken from its recv_queue and classified by
+ * destination MAC address. Each frame is copied into a buffer from the
+ * destination's tx pool. Broadcast and multicast frames go to every other
+ * node, with one copy for each distinct pool among them. The received
+ * buffers are returned to the source straight away, and the copies are
+ * added to the destinations' send_queues in one batch per destination.
+ * Buffers the destinations have finished with are first recycled to their
+ * pools. Both sides are notified as their virtqueues ask to be.
+ *
+ * @param lib Initialized instance of this library.
+ * @param burst Most frames to take from each node, at most
+ *              VSWITCH_MAX_BURST. 0 means VSWITCH_MAX_BURST.
+ * @return The number of frames added to send_queues.
+ */
+unsigned vswitch_forward_burst(vswitch_t *lib, unsigned burst);
+
 /** Checks to see if a destination with the MAC address "mac" has been registered with
- * the library.
+ * the library. This is a lookup in the forwarding database, so its cost
+ * doesn't depend on the number of nodes.
  *
  * @param lib Initialized instance of this library.
  * @param mac Mac address of the destination to be looked up.
@@ -127,7 +251,7 @@ int vswitch_get_destnode_index_by_macaddr(vswitch_t *lib,
 
 /** Used to iterate through all the registered destinations indiscriminately.
  * @param lib Initialized instance of this library.
- * @param index Positive integer from 0 to VSWITCH_NUM_NODES.
+ * @param index Positive integer from 0 to lib->num_nodes.
  * @return NULL if an invalid index is supplied. Non-NULL if a valid index is
  *              supplied.
  */
@@ -10,6 +10,7 @@
 #include <assert.h>
 
 #include <vswitch.h>
+#include <utils/util.h>
 #include <utils/zf_log.h>
 #include <utils/fence.h>
 
@@ -25,7 +26,7 @@ struct ether_addr ipv6_multicast_macaddr = { .ether_addr_octet = {
 
 static int vswitch_find_free_slot(vswitch_t *lib)
 {
-    for (int i = 0; i < VSWITCH_NUM_NODES; i++) {
+    for (size_t i = 0; i < lib->num_nodes; i++) {
         if (mac802_addr_eq((void *)&lib->nodes[i].addr, &null_macaddr)) {
             return i;
         }
@@ -34,22 +35,104 @@ static int vswitch_find_free_slot(vswitch_t *lib)
     return -1;
 }
 
+/* Fibonacci hashing: the index is the top bits of the product, which
+ * depend on every bit of the key. Multiplying the whole address by one
+ * constant still bunches up addresses that differ only in the fifth
+ * octet, so the last two octets are scrambled with the 32-bit constant
+ * and folded onto the first four. Addresses in a topology that differ in
+ * any single octet then spread across the table.
+ */
+static inline size_t vswitch_fdb_hash(vswitch_t *lib, uint64_t key)
+{
+    uint32_t folded = (uint32_t)key ^ (uint32_t)(key >> 32) * 0x9E3779B9u;
+
+    return (size_t)((folded * 0x9E3779B97F4A7C15ull) >> (64 - lib->fdb_bits));
+}
+
+/* Find the entry for a key, or the empty entry where it would go */
+static vswitch_fdb_entry_t *vswitch_fdb_find(vswitch_t *lib, uint64_t key)
+{
+    size_t i = vswitch_fdb_hash(lib, key);
+
+    while (lib->fdb[i].key != key && lib->fdb[i].key != 0) {
+        i = (i + 1) & lib->fdb_mask;
+    }
+    return &lib->fdb[i];
+}
+
 int vswitch_init(vswitch_t *lib)
 {
+    return vswitch_init_with_size(lib, VSWITCH_NUM_NODES);
+}
+
+int vswitch_init_with_size(vswitch_t *lib, size_t num_nodes)
+{
+    size_t fdb_size = 2;
+    unsigned fdb_bits = 1;
+
     memset((void *)lib, 0, sizeof(*lib));
+
+    /* At least twice as many entries as nodes keeps probe chains short */
+    while (fdb_size < num_nodes * 2) {
+        fdb_size *= 2;
+        fdb_bits++;
+    }
+
+    lib->nodes = calloc(num_nodes, sizeof(*lib->nodes));
+    lib->fdb = calloc(fdb_size, sizeof(*lib->fdb));
+    lib->tx_bufs = calloc(num_nodes * VSWITCH_MAX_BURST, sizeof(*lib->tx_bufs));
+    lib->tx_pending = calloc(num_nodes, sizeof(*lib->tx_pending));
+    /* One spare entry, for the pool a node moves to while it still holds its old one */
+    lib->tx_pools = calloc(num_nodes + 1, sizeof(*lib->tx_pools));
+    if (lib->nodes == NULL || lib->fdb == NULL || lib->tx_bufs == NULL ||
+        lib->tx_pending == NULL || lib->tx_pools == NULL) {
+        ZF_LOGE("Failed to allocate vswitch for %zu nodes.", num_nodes);
+        vswitch_free(lib);
+        return -1;
+    }
+    for (size_t i = 0; i < num_nodes; i++) {
+        lib->nodes[i].tx = lib->tx_bufs + i * VSWITCH_MAX_BURST;
+    }
+    lib->num_nodes = num_nodes;
+    lib->fdb_mask = fdb_size - 1;
+    lib->fdb_bits = fdb_bits;
+    /* Unused entries of tx_pools have a frame_seq of 0, which is never current */
+    lib->frame_seq = 1;
     return 0;
 }
 
+void vswitch_free(vswitch_t *lib)
+{
+    free(lib->nodes);
+    free(lib->fdb);
+    free(lib->tx_bufs);
+    free(lib->tx_pending);
+    if (lib->tx_pools != NULL) {
+        for (size_t i = 0; i <= lib->num_nodes; i++) {
+            free(lib->tx_pools[i].refs);
+        }
+    }
+    free(lib->tx_pools);
+    memset((void *)lib, 0, sizeof(*lib));
+}
+
 int vswitch_connect(vswitch_t *lib,
                     struct ether_addr *guest_macaddr,
                     virtqueue_driver_t *send_virtqueue,
                     virtqueue_device_t *recv_virtqueue)
 {
+    vswitch_fdb_entry_t *entry;
+    uint64_t key = mac802_addr_to_u64(guest_macaddr);
     int slot;
 
-    assert(lib->n_connected <= VSWITCH_NUM_NODES);
+    assert(lib->n_connected >= 0 && (size_t)lib->n_connected <= lib->num_nodes);
+
+    if (key == 0) {
+        ZF_LOGE("Can't connect a client with a null MAC address.");
+        return -1;
+    }
 
-    if (lib->n_connected == VSWITCH_NUM_NODES) {
+    if ((size_t)lib->n_connected == lib->num_nodes) {
         ZF_LOGE("No slots remaining to allow client " PR_MAC802_ADDR " to "
                 "connect.",
                 PR_MAC802_ADDR_ARGS(guest_macaddr));
@@ -57,6 +140,13 @@ int vswitch_connect(vswitch_t *lib,
         return -1;
     }
 
+    entry = vswitch_fdb_find(lib, key);
+    if (entry->key == key) {
+        ZF_LOGE("Client " PR_MAC802_ADDR " is already connected.",
+                PR_MAC802_ADDR_ARGS(guest_macaddr));
+        return -1;
+    }
+
     slot = vswitch_find_free_slot(lib);
     if (slot < 0) {
         ZF_LOGE("Failed to find free slot for new client " PR_MAC802_ADDR ".",
@@ -69,6 +159,8 @@ int vswitch_connect(vswitch_t *lib,
            sizeof(*guest_macaddr));
     lib->nodes[slot].virtqueues.send_queue = send_virtqueue;
     lib->nodes[slot].virtqueues.recv_queue = recv_virtqueue;
+    entry->node = slot;
+    entry->key = key;
     lib->n_connected++;
 
     ZF_LOGI("Added new route to guest at MAC " PR_MAC802_ADDR,
@@ -77,20 +169,312 @@ int vswitch_connect(vswitch_t *lib,
     return 0;
 }
 
+/* Find the entry for a pool in tx_pools, creating it if need be */
+static vswitch_tx_pool_t *vswitch_get_tx_pool(vswitch_t *lib, vq_pool_t *pool)
+{
+    vswitch_tx_pool_t *free_entry = NULL;
+
+    for (size_t i = 0; i <= lib->num_nodes; i++) {
+        if (lib->tx_pools[i].pool == pool) {
+            return &lib->tx_pools[i];
+        }
+        if (lib->tx_pools[i].pool == NULL && free_entry == NULL) {
+            free_entry = &lib->tx_pools[i];
+        }
+    }
+
+    /* Each entry in use has a node, so the spare entry leaves one free
+     * even while a node is moving between pools
+     */
+    if (free_entry == NULL) {
+        ZF_LOGE("No free tx pool entry.");
+        return NULL;
+    }
+    free_entry->refs = calloc(pool->count, sizeof(*free_entry->refs));
+    if (free_entry->refs == NULL) {
+        ZF_LOGE("Failed to allocate reference counts for %u buffers.", pool->count);
+        return NULL;
+    }
+    free_entry->pool = pool;
+    return free_entry;
+}
+
+static void vswitch_put_tx_pool(vswitch_tx_pool_t *txp)
+{
+    if (--txp->users == 0) {
+        free(txp->refs);
+        memset((void *)txp, 0, sizeof(*txp));
+    }
+}
+
+/* Drop a reference to a buffer, giving it back to the pool with the last one */
+static void vswitch_buf_put(vswitch_tx_pool_t *txp, void *buf)
+{
+    size_t index;
+
+    if (!vq_pool_contains(txp->pool, buf)) {
+        ZF_LOGE("Buffer %p is not in the tx pool.", buf);
+        return;
+    }
+    index = ((char *)buf - txp->pool->bufs) / txp->pool->buf_size;
+    if (--txp->refs[index] == 0) {
+        vq_pool_free(txp->pool, buf);
+    }
+}
+
+/* Give the buffers of the frames a node has finished with back to its pool */
+static void vswitch_reclaim(vswitch_node_t *node)
+{
+    virtqueue_driver_t *vq = node->virtqueues.send_queue;
+    virtqueue_ring_object_t robjs[VSWITCH_MAX_BURST];
+    uint32_t lens[VSWITCH_MAX_BURST];
+    unsigned n;
+
+    while ((n = virtqueue_get_used_bufs(vq, robjs, lens, VSWITCH_MAX_BURST)) > 0) {
+        for (unsigned i = 0; i < n; i++) {
+            void *buf;
+            unsigned len;
+            vq_flags_t flag;
+
+            while (virtqueue_gather_used(vq, &robjs[i], &buf, &len, &flag)) {
+                vswitch_buf_put(node->tx_pool, buf);
+            }
+        }
+        node->in_flight -= n;
+    }
+}
+
+int vswitch_set_tx_pool(vswitch_t *lib, struct ether_addr *mac, vq_pool_t *pool)
+{
+    int idx = vswitch_get_destnode_index_by_macaddr(lib, mac);
+    vswitch_node_t *node;
+    vswitch_tx_pool_t *txp = NULL;
+
+    if (idx < 0) {
+        ZF_LOGE("Client " PR_MAC802_ADDR " is not connected.",
+                PR_MAC802_ADDR_ARGS(mac));
+        return -1;
+    }
+    node = &lib->nodes[idx];
+
+    if (node->tx_pool != NULL && node->tx_pool->pool == pool) {
+        return 0;
+    }
+    if (node->tx_pool != NULL && node->virtqueues.send_queue != NULL) {
+        vswitch_reclaim(node);
+    }
+    if (node->in_flight != 0) {
+        ZF_LOGE("Client " PR_MAC802_ADDR " still holds %u frames from its tx pool.",
+                PR_MAC802_ADDR_ARGS(mac), node->in_flight);
+        return -1;
+    }
+
+    if (pool != NULL) {
+        txp = vswitch_get_tx_pool(lib, pool);
+        if (txp == NULL) {
+            return -1;
+        }
+        txp->users++;
+    }
+    if (node->tx_pool != NULL) {
+        vswitch_put_tx_pool(node->tx_pool);
+    }
+    node->tx_pool = txp;
+    return 0;
+}
+
+/* Get a copy of the current frame in a tx pool. The frame is only copied
+ * into each pool once, however many of the pool's nodes it goes to.
+ */
+static char *vswitch_copy(vswitch_t *lib, vswitch_tx_pool_t *txp, vq_buf_t *segs,
+                          unsigned nsegs, size_t len)
+{
+    char *buf;
+    size_t off = 0;
+
+    if (txp->frame_seq == lib->frame_seq) {
+        return txp->frame;
+    }
+    if (len > txp->pool->buf_size || (buf = vq_pool_alloc(txp->pool)) == NULL) {
+        return NULL;
+    }
+    for (unsigned i = 0; i < nsegs; i++) {
+        memcpy(buf + off, segs[i].buf, segs[i].len);
+        off += segs[i].len;
+    }
+    txp->frame = buf;
+    txp->frame_seq = lib->frame_seq;
+    return buf;
+}
+
+/* Take a reference to a copy of the current frame in a node's pool, ready
+ * to be added to its send_queue.
+ */
+static void vswitch_stage(vswitch_t *lib, int dest, vq_buf_t *segs, unsigned nsegs,
+                          size_t len)
+{
+    vswitch_node_t *node = &lib->nodes[dest];
+    vswitch_tx_pool_t *txp = node->tx_pool;
+    char *buf;
+
+    if (txp == NULL || node->virtqueues.send_queue == NULL ||
+        (buf = vswitch_copy(lib, txp, segs, nsegs, len)) == NULL) {
+        lib->dropped++;
+        return;
+    }
+    txp->refs[(buf - txp->pool->bufs) / txp->pool->buf_size]++;
+
+    if (node->n_tx == 0) {
+        lib->tx_pending[lib->n_tx_pending++] = dest;
+    }
+    node->tx[node->n_tx].buf = buf;
+    node->tx[node->n_tx].len = len;
+    node->tx[node->n_tx].flag = VQ_READ;
+    node->n_tx++;
+}
+
+/* Work out where a frame from node "src" goes and stage copies of it */
+static void vswitch_classify(vswitch_t *lib, int src, vq_buf_t *segs, unsigned nsegs,
+                             size_t len)
+{
+    struct ether_addr *dst;
+    int dest;
+
+    /* Copies of the previous frame are no longer current */
+    lib->frame_seq++;
+
+    /* The destination address must be contiguous, the rest may be scattered */
+    if (len < sizeof(struct ether_header) || segs[0].len < ETH_ALEN) {
+        lib->dropped++;
+        return;
+    }
+    dst = segs[0].buf;
+
+    if (mac802_addr_is_group(dst)) {
+        for (int i = 0; i < lib->n_connected; i++) {
+            if (i != src) {
+                vswitch_stage(lib, i, segs, nsegs, len);
+            }
+        }
+        return;
+    }
+
+    dest = vswitch_get_destnode_index_by_macaddr(lib, dst);
+    if (dest < 0 || dest == src) {
+        lib->dropped++;
+        return;
+    }
+    vswitch_stage(lib, dest, segs, nsegs, len);
+}
+
+/* Add the staged frames to the send_queues, one batch per destination */
+static void vswitch_flush(vswitch_t *lib)
+{
+    for (size_t i = 0; i < lib->n_tx_pending; i++) {
+        vswitch_node_t *node = &lib->nodes[lib->tx_pending[i]];
+        virtqueue_driver_t *vq = node->virtqueues.send_queue;
+        unsigned added = virtqueue_add_available_bufs(vq, node->tx, node->n_tx);
+
+        /* Frames that don't fit in the ring are dropped, as a NIC would */
+        for (unsigned j = added; j < node->n_tx; j++) {
+            vswitch_buf_put(node->tx_pool, node->tx[j].buf);
+            lib->dropped++;
+        }
+        lib->forwarded += added;
+        node->in_flight += added;
+        node->n_tx = 0;
+
+        if (added > 0 && virtqueue_driver_should_notify(vq) && vq->notify != NULL) {
+            vq->notify();
+        }
+    }
+    lib->n_tx_pending = 0;
+}
+
+unsigned vswitch_forward_burst(vswitch_t *lib, unsigned burst)
+{
+    virtqueue_ring_object_t robjs[VSWITCH_MAX_BURST];
+    uint32_t lens[VSWITCH_MAX_BURST];
+    vq_buf_t segs[VSWITCH_MAX_FRAME_SEGS];
+    uint64_t forwarded = lib->forwarded;
+
+    if (burst == 0 || burst > VSWITCH_MAX_BURST) {
+        burst = VSWITCH_MAX_BURST;
+    }
+
+    for (int i = 0; i < lib->n_connected; i++) {
+        if (lib->nodes[i].tx_pool != NULL && lib->nodes[i].virtqueues.send_queue != NULL) {
+            vswitch_reclaim(&lib->nodes[i]);
+        }
+    }
+
+    for (int src = 0; src < lib->n_connected; src++) {
+        virtqueue_device_t *vq = lib->nodes[src].virtqueues.recv_queue;
+        unsigned n;
+
+        if (vq == NULL) {
+            continue;
+        }
+        n = virtqueue_get_available_bufs(vq, robjs, burst);
+        if (n == 0) {
+            continue;
+        }
+
+        for (unsigned i = 0; i < n; i++) {
+            unsigned nsegs = virtqueue_gather_available_bufs(vq, &robjs[i], segs,
+                                                             VSWITCH_MAX_FRAME_SEGS);
+            vq_buf_t extra;
+            size_t len = 0;
+
+            for (unsigned j = 0; j < nsegs; j++) {
+                len += segs[j].len;
+            }
+            if (virtqueue_gather_available_bufs(vq, &robjs[i], &extra, 1) != 0) {
+                ZF_LOGE("Dropping frame of more than %d buffers.", VSWITCH_MAX_FRAME_SEGS);
+                lib->dropped++;
+            } else {
+                vswitch_classify(lib, src, segs, nsegs, len);
+            }
+            /* The switch only reads the frames */
+            lens[i] = 0;
+        }
+
+        /* Everything has been copied out, so the source can have its
+         * buffers back before the frames are delivered.
+         */
+        virtqueue_add_used_bufs(vq, robjs, lens, n);
+        if (virtqueue_device_should_notify(vq) && vq->notify != NULL) {
+            vq->notify();
+        }
+        vswitch_flush(lib);
+    }
+
+    return lib->forwarded - forwarded;
+}
+
 int vswitch_get_destnode_index_by_macaddr(vswitch_t *lib,
                                           struct ether_addr *mac)
 {
-    for (int i = 0; i < VSWITCH_NUM_NODES; i++) {
-        if (mac802_addr_eq((void *)&lib->nodes[i].addr, mac)) {
-            return i;
-        }
+    uint64_t key = mac802_addr_to_u64(mac);
+    vswitch_fdb_entry_t *entry;
+
+    if (key == 0) {
+        return -1;
+    }
+    entry = vswitch_fdb_find(lib, key);
+    if (entry->key != key) {
+        return -1;
     }
 
-    return -1;
+    return entry->node;
 }
 
 vswitch_node_t *vswitch_get_destnode_by_index(vswitch_t *lib, size_t index)
 {
+    if (index >= lib->num_nodes) {
+        return NULL;
+    }
+
     if (mac802_addr_eq((void *)&lib->nodes[index].addr, &null_macaddr)) {
         /* If the index requested is has a NULL mac addr in it, return
          * error.
@@ -0,0 +1,17 @@
+/*
+ * Copyright 2018, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/* The logging macros libvswitch uses, for building the host tests without util_libs */
+
+#pragma once
+
+#include <stdio.h>
+#include <utils/util.h>
+
+/* utils/util.h from the libvirtqueue benchmark labels errors as its own */
+#undef ZF_LOGE
+#define ZF_LOGE(fmt, ...) fprintf(stderr, "vswitch: " fmt "\n", ##__VA_ARGS__)
+#define ZF_LOGI(...) do { } while (0)
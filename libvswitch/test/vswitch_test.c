@@ -0,0 +1,657 @@
+/*
+ * Copyright 2018, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/* Host tests for libvswitch.
+ *
+ * Each test sets up a switch on its own and checks it through the public
+ * interface, looking into vswitch_t only where the interface gives no
+ * other view, such as the occupancy of the forwarding database. Failed
+ * checks are reported on stderr and make the exit status non-zero.
+ *
+ * The forwarding tests run the nodes in the same thread as the switch.
+ * Each node has the other half of its two virtqueues: it is the driver
+ * of the queue it sends frames on and the device of the queue the switch
+ * sends frames to it on. Buffer addresses in the descriptors are plain
+ * pointers, as every side shares the one address space.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vswitch.h>
+
+/* Longest run of occupied forwarding database entries allowed when the
+ * table is at its fill limit of one half
+ */
+#define MAX_FDB_RUN         8
+/* Entries in each virtqueue */
+#define QUEUE_LEN           16
+/* Buffers in each tx pool, and their size */
+#define POOL_BUFS           32
+#define POOL_BUF_SIZE       128
+/* Most nodes in a forwarding test */
+#define MAX_TEST_NODES      4
+
+static unsigned failures;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+/* A locally administered unicast address with one octet set to val */
+static struct ether_addr test_mac(unsigned octet, uint8_t val)
+{
+    struct ether_addr mac = { .ether_addr_octet = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 } };
+
+    if (octet == 0) {
+        /* Keep the locally administered bit set and the group bit clear */
+        val = (uint8_t)(val << 2) | 0x02;
+    }
+    mac.ether_addr_octet[octet] = val;
+    return mac;
+}
+
+/* Longest run of consecutive occupied entries in the forwarding database,
+ * wrapping around the end. A lookup probes at most this many entries.
+ */
+static size_t fdb_longest_run(vswitch_t *lib)
+{
+    size_t size = lib->fdb_mask + 1;
+    size_t longest = 0;
+    size_t run = 0;
+
+    /* Going round twice counts a run that wraps */
+    for (size_t i = 0; i < 2 * size; i++) {
+        if (lib->fdb[i & lib->fdb_mask].key != 0) {
+            run++;
+            longest = run > longest ? run : longest;
+        } else {
+            run = 0;
+        }
+    }
+    return longest > size ? size : longest;
+}
+
+/* The far end of a node's link to the switch */
+typedef struct test_node {
+    struct ether_addr mac;
+    virtqueue_driver_t send;        /* Switch side of the frames to the node */
+    virtqueue_device_t send_peer;   /* Node side of the frames to the node */
+    virtqueue_driver_t recv_peer;   /* Node side of the frames from the node */
+    virtqueue_device_t recv;        /* Switch side of the frames from the node */
+    void *send_ring;
+    void *recv_ring;
+    char frames[QUEUE_LEN][POOL_BUF_SIZE]; /* Frames the node sends */
+    unsigned next_frame;
+    void *held[QUEUE_LEN];          /* Buffers the node has been sent and not yet returned */
+    virtqueue_ring_object_t held_robjs[QUEUE_LEN];
+    unsigned n_held;
+} test_node_t;
+
+typedef struct test_topology {
+    vswitch_t lib;
+    unsigned n;
+    test_node_t nodes[MAX_TEST_NODES];
+    vq_pool_t pools[MAX_TEST_NODES];
+    void *pool_mem[MAX_TEST_NODES];
+} test_topology_t;
+
+static void *test_alloc(size_t size)
+{
+    void *mem;
+
+    if (posix_memalign(&mem, VQ_CACHE_LINE, size) != 0) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memset(mem, 0, size);
+    return mem;
+}
+
+static void *test_ring(vq_layout_t *layout, virtqueue_driver_t *drv, virtqueue_device_t *dev)
+{
+    void *ring;
+
+    CHECK(virtqueue_layout(layout, QUEUE_LEN, 0, 0) == 0);
+    ring = test_alloc(layout->size);
+    virtqueue_init_driver(drv, QUEUE_LEN, (void *)((char *)ring + layout->avail),
+                          (void *)((char *)ring + layout->used), (void *)((char *)ring + layout->desc),
+                          NULL, NULL);
+    virtqueue_init_device(dev, QUEUE_LEN, (void *)((char *)ring + layout->avail),
+                          (void *)((char *)ring + layout->used), (void *)((char *)ring + layout->desc),
+                          NULL, NULL);
+    return ring;
+}
+
+/* Connect n nodes, giving node i the pool pool_of[i], or no pool if it is
+ * negative. Nodes given the same number share a pool.
+ */
+static void topology_init(test_topology_t *t, unsigned n, const int *pool_of)
+{
+    size_t pool_size = VQ_CACHE_LINE + POOL_BUFS * POOL_BUF_SIZE;
+
+    assert(n <= MAX_TEST_NODES);
+    memset(t, 0, sizeof(*t));
+    t->n = n;
+    CHECK(vswitch_init_with_size(&t->lib, n) == 0);
+    for (unsigned i = 0; i < MAX_TEST_NODES; i++) {
+        t->pool_mem[i] = test_alloc(pool_size);
+        CHECK(vq_pool_init(&t->pools[i], t->pool_mem[i], pool_size, POOL_BUF_SIZE) == 0);
+    }
+    for (unsigned i = 0; i < n; i++) {
+        test_node_t *node = &t->nodes[i];
+        vq_layout_t layout;
+
+        node->mac = test_mac(5, i + 1);
+        node->send_ring = test_ring(&layout, &node->send, &node->send_peer);
+        node->recv_ring = test_ring(&layout, &node->recv_peer, &node->recv);
+        CHECK(vswitch_connect(&t->lib, &node->mac, &node->send, &node->recv) == 0);
+        if (pool_of[i] >= 0) {
+            CHECK(vswitch_set_tx_pool(&t->lib, &node->mac, &t->pools[pool_of[i]]) == 0);
+        }
+    }
+}
+
+static void topology_free(test_topology_t *t)
+{
+    vswitch_free(&t->lib);
+    for (unsigned i = 0; i < t->n; i++) {
+        free(t->nodes[i].send_ring);
+        free(t->nodes[i].recv_ring);
+    }
+    for (unsigned i = 0; i < MAX_TEST_NODES; i++) {
+        free(t->pool_mem[i]);
+    }
+}
+
+/* Count the free buffers of a pool, leaving them free */
+static unsigned pool_free_count(vq_pool_t *pool)
+{
+    void *bufs[POOL_BUFS];
+    unsigned n = 0;
+
+    while (n < POOL_BUFS && (bufs[n] = vq_pool_alloc(pool)) != NULL) {
+        n++;
+    }
+    for (unsigned i = 0; i < n; i++) {
+        vq_pool_free(pool, bufs[i]);
+    }
+    return n;
+}
+
+/* Make a frame from node "src" to "dst" available to the switch */
+static void node_send(test_topology_t *t, unsigned src, struct ether_addr *dst, size_t len)
+{
+    test_node_t *node = &t->nodes[src];
+    char *frame = node->frames[node->next_frame++ % QUEUE_LEN];
+    struct ether_header *eh = (void *)frame;
+    vq_buf_t buf = { .buf = frame, .len = len, .flag = VQ_READ };
+
+    assert(len <= POOL_BUF_SIZE);
+    memset(frame, (int)(src + 1), len);
+    if (len >= sizeof(*eh)) {
+        memcpy(eh->ether_dhost, dst, ETH_ALEN);
+        memcpy(eh->ether_shost, &node->mac, ETH_ALEN);
+    }
+    CHECK(virtqueue_add_available_bufs(&node->recv_peer, &buf, 1) == 1);
+}
+
+/* Take back the frames node "src" sent that the switch has finished with */
+static unsigned node_reclaim_sent(test_topology_t *t, unsigned src)
+{
+    test_node_t *node = &t->nodes[src];
+    virtqueue_ring_object_t robj;
+    uint32_t len;
+    unsigned n = 0;
+
+    while (virtqueue_get_used_bufs(&node->recv_peer, &robj, &len, 1) == 1) {
+        void *buf;
+        unsigned buf_len;
+        vq_flags_t flag;
+
+        while (virtqueue_gather_used(&node->recv_peer, &robj, &buf, &buf_len, &flag));
+        n++;
+    }
+    return n;
+}
+
+/* Take the frames the switch has sent to node "dst", checking that each
+ * came from node "src", and hold on to them
+ */
+static unsigned node_receive(test_topology_t *t, unsigned dst, unsigned src, size_t len)
+{
+    test_node_t *node = &t->nodes[dst];
+    unsigned n = 0;
+
+    while (node->n_held < QUEUE_LEN &&
+           virtqueue_get_available_bufs(&node->send_peer, &node->held_robjs[node->n_held], 1) == 1) {
+        virtqueue_ring_object_t *robj = &node->held_robjs[node->n_held];
+        vq_buf_t seg;
+        struct ether_header *eh;
+
+        CHECK(virtqueue_gather_available_bufs(&node->send_peer, robj, &seg, 1) == 1);
+        eh = seg.buf;
+        CHECK(seg.len == len);
+        CHECK(mac802_addr_eq((void *)eh->ether_shost, &t->nodes[src].mac));
+        CHECK(((unsigned char *)seg.buf)[len - 1] == src + 1);
+        node->held[node->n_held++] = seg.buf;
+        n++;
+    }
+    return n;
+}
+
+/* Give the switch back the frames node "dst" is holding */
+static void node_complete(test_topology_t *t, unsigned dst)
+{
+    test_node_t *node = &t->nodes[dst];
+    uint32_t lens[QUEUE_LEN] = { 0 };
+
+    CHECK(virtqueue_add_used_bufs(&node->send_peer, node->held_robjs, lens, node->n_held) ==
+          node->n_held);
+    node->n_held = 0;
+}
+
+static void test_init_with_size(void)
+{
+    vswitch_t lib;
+    size_t n = 100;
+
+    CHECK(vswitch_init_with_size(&lib, n) == 0);
+    CHECK(lib.num_nodes == n);
+    CHECK(lib.fdb_mask + 1 >= 2 * n);
+    CHECK(((lib.fdb_mask + 1) & lib.fdb_mask) == 0);
+    CHECK((size_t)1 << lib.fdb_bits == lib.fdb_mask + 1);
+
+    for (unsigned i = 0; i < n; i++) {
+        struct ether_addr mac = test_mac(4, i + 1);
+        CHECK(vswitch_connect(&lib, &mac, NULL, NULL) == 0);
+    }
+    CHECK((size_t)lib.n_connected == n);
+
+    /* The table is full */
+    struct ether_addr extra = test_mac(3, 1);
+    CHECK(vswitch_connect(&lib, &extra, NULL, NULL) != 0);
+    CHECK((size_t)lib.n_connected == n);
+
+    for (unsigned i = 0; i < n; i++) {
+        struct ether_addr mac = test_mac(4, i + 1);
+        int idx = vswitch_get_destnode_index_by_macaddr(&lib, &mac);
+        vswitch_node_t *node = vswitch_get_destnode_by_macaddr(&lib, &mac);
+
+        CHECK(idx >= 0 && (size_t)idx < n);
+        CHECK(node != NULL && mac802_addr_eq(&node->addr, &mac));
+        CHECK(node == vswitch_get_destnode_by_index(&lib, idx));
+    }
+    CHECK(vswitch_get_destnode_by_index(&lib, n) == NULL);
+
+    vswitch_free(&lib);
+    CHECK(lib.nodes == NULL && lib.fdb == NULL && lib.num_nodes == 0);
+}
+
+static void test_init_default(void)
+{
+    vswitch_t lib;
+
+    CHECK(vswitch_init(&lib) == 0);
+    CHECK(lib.num_nodes == VSWITCH_NUM_NODES);
+    for (unsigned i = 0; i < VSWITCH_NUM_NODES; i++) {
+        struct ether_addr mac = test_mac(5, i + 1);
+        CHECK(vswitch_connect(&lib, &mac, NULL, NULL) == 0);
+    }
+    struct ether_addr extra = test_mac(5, VSWITCH_NUM_NODES + 1);
+    CHECK(vswitch_connect(&lib, &extra, NULL, NULL) != 0);
+    vswitch_free(&lib);
+}
+
+static void test_connect_rejects(void)
+{
+    vswitch_t lib;
+    struct ether_addr a = test_mac(5, 1);
+    struct ether_addr b = test_mac(5, 2);
+
+    CHECK(vswitch_init(&lib) == 0);
+
+    CHECK(vswitch_connect(&lib, &null_macaddr, NULL, NULL) != 0);
+    CHECK(lib.n_connected == 0);
+    CHECK(vswitch_get_destnode_index_by_macaddr(&lib, &null_macaddr) < 0);
+
+    CHECK(vswitch_connect(&lib, &a, NULL, NULL) == 0);
+    CHECK(vswitch_connect(&lib, &a, NULL, NULL) != 0);
+    CHECK(lib.n_connected == 1);
+
+    CHECK(vswitch_get_destnode_index_by_macaddr(&lib, &a) == 0);
+    CHECK(vswitch_get_destnode_index_by_macaddr(&lib, &b) < 0);
+    CHECK(vswitch_get_destnode_by_macaddr(&lib, &b) == NULL);
+    CHECK(vswitch_get_destnode_by_macaddr(&lib, &null_macaddr) == NULL);
+
+    CHECK(vswitch_connect(&lib, &b, NULL, NULL) == 0);
+    CHECK(vswitch_get_destnode_index_by_macaddr(&lib, &b) == 1);
+
+    vswitch_free(&lib);
+}
+
+/* Addresses in a topology are often handed out in sequence, so they
+ * differ in a single octet. Whichever octet that is, the forwarding
+ * database must spread them rather than pile them onto one entry.
+ */
+static void test_fdb_probe_lengths(void)
+{
+    const unsigned n = 32;
+
+    for (unsigned octet = 0; octet < ETH_ALEN; octet++) {
+        vswitch_t lib;
+        size_t run;
+
+        CHECK(vswitch_init_with_size(&lib, n) == 0);
+        for (unsigned i = 0; i < n; i++) {
+            struct ether_addr mac = test_mac(octet, i + 1);
+            CHECK(vswitch_connect(&lib, &mac, NULL, NULL) == 0);
+        }
+        for (unsigned i = 0; i < n; i++) {
+            struct ether_addr mac = test_mac(octet, i + 1);
+            CHECK(vswitch_get_destnode_index_by_macaddr(&lib, &mac) == (int)i);
+        }
+
+        run = fdb_longest_run(&lib);
+        if (run > MAX_FDB_RUN) {
+            fprintf(stderr, "octet %u: %zu entries probed in a table of %zu\n", octet, run,
+                    lib.fdb_mask + 1);
+        }
+        CHECK(run <= MAX_FDB_RUN);
+        vswitch_free(&lib);
+    }
+}
+
+static void test_forward_unicast(void)
+{
+    static const int pool_of[] = { 0, 1, 2 };
+    test_topology_t t;
+
+    topology_init(&t, 3, pool_of);
+
+    node_send(&t, 0, &t.nodes[2].mac, 64);
+    node_send(&t, 1, &t.nodes[0].mac, 100);
+    CHECK(vswitch_forward_burst(&t.lib, 0) == 2);
+    CHECK(t.lib.forwarded == 2 && t.lib.dropped == 0);
+
+    /* The sources get their buffers back straight away */
+    CHECK(node_reclaim_sent(&t, 0) == 1);
+    CHECK(node_reclaim_sent(&t, 1) == 1);
+
+    CHECK(node_receive(&t, 2, 0, 64) == 1);
+    CHECK(node_receive(&t, 0, 1, 100) == 1);
+    CHECK(node_receive(&t, 1, 0, 64) == 0);
+    CHECK(pool_free_count(&t.pools[2]) == POOL_BUFS - 1);
+    CHECK(pool_free_count(&t.pools[0]) == POOL_BUFS - 1);
+
+    /* Buffers come back to the pools on the next call once the nodes are done */
+    node_complete(&t, 2);
+    node_complete(&t, 0);
+    CHECK(vswitch_forward_burst(&t.lib, 0) == 0);
+    CHECK(pool_free_count(&t.pools[2]) == POOL_BUFS);
+    CHECK(pool_free_count(&t.pools[0]) == POOL_BUFS);
+
+    topology_free(&t);
+}
+
+static void test_forward_drops(void)
+{
+    static const int pool_of[] = { 0, 1, -1 };
+    test_topology_t t;
+    struct ether_addr unknown = test_mac(3, 7);
+
+    topology_init(&t, 3, pool_of);
+
+    node_send(&t, 0, &unknown, 64);
+    node_send(&t, 0, &t.nodes[0].mac, 64);
+    /* Too short for an Ethernet header */
+    node_send(&t, 0, &t.nodes[1].mac, 10);
+    /* Node 2 has no pool to copy into */
+    node_send(&t, 0, &t.nodes[2].mac, 64);
+    CHECK(vswitch_forward_burst(&t.lib, 0) == 0);
+    CHECK(t.lib.dropped == 4);
+
+    /* Dropped frames still go back to their source */
+    CHECK(node_reclaim_sent(&t, 0) == 4);
+    for (unsigned i = 0; i < 3; i++) {
+        CHECK(node_receive(&t, i, 0, 64) == 0);
+    }
+    CHECK(pool_free_count(&t.pools[0]) == POOL_BUFS);
+    CHECK(pool_free_count(&t.pools[1]) == POOL_BUFS);
+
+    topology_free(&t);
+}
+
+/* A node connected without a send_queue has its frames dropped, even
+ * with a pool
+ */
+static void test_forward_no_send_queue(void)
+{
+    static const int pool_of[] = { 0, 1, 2 };
+    test_topology_t t;
+
+    topology_init(&t, 3, pool_of);
+    vswitch_get_destnode_by_macaddr(&t.lib, &t.nodes[2].mac)->virtqueues.send_queue = NULL;
+
+    node_send(&t, 0, &t.nodes[2].mac, 64);
+    CHECK(vswitch_forward_burst(&t.lib, 0) == 0);
+    CHECK(t.lib.dropped == 1);
+    node_send(&t, 0, &bcast_macaddr, 64);
+    CHECK(vswitch_forward_burst(&t.lib, 0) == 1);
+    CHECK(t.lib.dropped == 2);
+    CHECK(node_receive(&t, 1, 0, 64) == 1);
+    CHECK(node_receive(&t, 2, 0, 64) == 0);
+    CHECK(pool_free_count(&t.pools[2]) == POOL_BUFS);
+
+    topology_free(&t);
+}
+
+static void test_forward_burst_limit(void)
+{
+    static const int pool_of[] = { 0, 1 };
+    test_topology_t t;
+
+    topology_init(&t, 2, pool_of);
+
+    for (unsigned i = 0; i < 5; i++) {
+        node_send(&t, 0, &t.nodes[1].mac, 64);
+    }
+    CHECK(vswitch_forward_burst(&t.lib, 2) == 2);
+    CHECK(node_reclaim_sent(&t, 0) == 2);
+    CHECK(vswitch_forward_burst(&t.lib, 2) == 2);
+    CHECK(vswitch_forward_burst(&t.lib, 2) == 1);
+    CHECK(vswitch_forward_burst(&t.lib, 2) == 0);
+    CHECK(node_reclaim_sent(&t, 0) == 3);
+    CHECK(node_receive(&t, 1, 0, 64) == 5);
+
+    topology_free(&t);
+}
+
+/* A node's pool can't be changed while it holds frames from it */
+static void test_set_tx_pool_in_flight(void)
+{
+    static const int pool_of[] = { 0, 1 };
+    test_topology_t t;
+
+    topology_init(&t, 2, pool_of);
+
+    node_send(&t, 0, &t.nodes[1].mac, 64);
+    node_send(&t, 0, &t.nodes[1].mac, 64);
+    CHECK(vswitch_forward_burst(&t.lib, 0) == 2);
+    CHECK(node_receive(&t, 1, 0, 64) == 2);
+    CHECK(pool_free_count(&t.pools[1]) == POOL_BUFS - 2);
+
+    CHECK(vswitch_set_tx_pool(&t.lib, &t.nodes[1].mac, &t.pools[0]) != 0);
+    CHECK(vswitch_set_tx_pool(&t.lib, &t.nodes[1].mac, NULL) != 0);
+    /* Setting the same pool again changes nothing */
+    CHECK(vswitch_set_tx_pool(&t.lib, &t.nodes[1].mac, &t.pools[1]) == 0);
+
+    /* Once the node is done, the switch reclaims the frames itself */
+    node_complete(&t, 1);
+    CHECK(vswitch_set_tx_pool(&t.lib, &t.nodes[1].mac, &t.pools[0]) == 0);
+    CHECK(pool_free_count(&t.pools[1]) == POOL_BUFS);
+
+    /* Both nodes now share pool 0 */
+    node_send(&t, 0, &t.nodes[1].mac, 64);
+    CHECK(vswitch_forward_burst(&t.lib, 0) == 1);
+    CHECK(node_receive(&t, 1, 0, 64) == 1);
+    CHECK(vswitch_get_destnode_by_macaddr(&t.lib, &t.nodes[1].mac)->tx_pool->pool == &t.pools[0]);
+    CHECK(pool_free_count(&t.pools[0]) == POOL_BUFS - 1);
+    node_complete(&t, 1);
+    CHECK(vswitch_forward_burst(&t.lib, 0) == 0);
+
+    /* With every node on a pool of its own, each can still move to a new one */
+    CHECK(vswitch_set_tx_pool(&t.lib, &t.nodes[1].mac, &t.pools[1]) == 0);
+    CHECK(vswitch_set_tx_pool(&t.lib, &t.nodes[0].mac, &t.pools[2]) == 0);
+    CHECK(vswitch_set_tx_pool(&t.lib, &t.nodes[1].mac, &t.pools[3]) == 0);
+    CHECK(vswitch_get_destnode_by_macaddr(&t.lib, &t.nodes[0].mac)->tx_pool->pool == &t.pools[2]);
+    CHECK(vswitch_get_destnode_by_macaddr(&t.lib, &t.nodes[1].mac)->tx_pool->pool == &t.pools[3]);
+    node_send(&t, 0, &t.nodes[1].mac, 64);
+    CHECK(vswitch_forward_burst(&t.lib, 0) == 1);
+    CHECK(node_receive(&t, 1, 0, 64) == 1);
+    CHECK(pool_free_count(&t.pools[3]) == POOL_BUFS - 1);
+    CHECK(pool_free_count(&t.pools[0]) == POOL_BUFS);
+
+    topology_free(&t);
+}
+
+/* A broadcast to nodes sharing a pool is copied once, and the copy only
+ * goes back to the pool once every one of them has completed it
+ */
+static void test_broadcast_shared_pool(void)
+{
+    static const int pool_of[] = { 0, 1, 1, 1 };
+    test_topology_t t;
+    void *copy;
+
+    topology_init(&t, 4, pool_of);
+
+    node_send(&t, 0, &bcast_macaddr, 64);
+    CHECK(vswitch_forward_burst(&t.lib, 0) == 3);
+    CHECK(pool_free_count(&t.pools[1]) == POOL_BUFS - 1);
+    CHECK(pool_free_count(&t.pools[0]) == POOL_BUFS);
+    CHECK(node_receive(&t, 0, 0, 64) == 0);
+    for (unsigned i = 1; i < 4; i++) {
+        CHECK(node_receive(&t, i, 0, 64) == 1);
+    }
+    copy = t.nodes[1].held[0];
+    CHECK(t.nodes[2].held[0] == copy && t.nodes[3].held[0] == copy);
+
+    node_complete(&t, 1);
+    CHECK(vswitch_forward_burst(&t.lib, 0) == 0);
+    CHECK(pool_free_count(&t.pools[1]) == POOL_BUFS - 1);
+    node_complete(&t, 3);
+    CHECK(vswitch_forward_burst(&t.lib, 0) == 0);
+    CHECK(pool_free_count(&t.pools[1]) == POOL_BUFS - 1);
+    node_complete(&t, 2);
+    CHECK(vswitch_forward_burst(&t.lib, 0) == 0);
+    CHECK(pool_free_count(&t.pools[1]) == POOL_BUFS);
+
+    topology_free(&t);
+}
+
+/* A multicast goes to every other node with one copy per distinct pool */
+static void test_multicast_mixed_pools(void)
+{
+    static const int pool_of[] = { 0, 1, 1, 2 };
+    struct ether_addr mcast = { .ether_addr_octet = { 0x33, 0x33, 0xff, 0x00, 0x00, 0x01 } };
+    test_topology_t t;
+
+    topology_init(&t, 4, pool_of);
+
+    node_send(&t, 3, &mcast, 80);
+    CHECK(vswitch_forward_burst(&t.lib, 0) == 3);
+    for (unsigned i = 0; i < 3; i++) {
+        CHECK(node_receive(&t, i, 3, 80) == 1);
+    }
+    node_send(&t, 0, &mcast, 90);
+    CHECK(vswitch_forward_burst(&t.lib, 0) == 3);
+    for (unsigned i = 1; i < 4; i++) {
+        CHECK(node_receive(&t, i, 0, 90) == 1);
+    }
+    CHECK(t.lib.dropped == 0);
+
+    /* Pool 1 holds one copy of each frame, shared by nodes 1 and 2 */
+    CHECK(pool_free_count(&t.pools[0]) == POOL_BUFS - 1);
+    CHECK(pool_free_count(&t.pools[1]) == POOL_BUFS - 2);
+    CHECK(pool_free_count(&t.pools[2]) == POOL_BUFS - 1);
+    CHECK(t.nodes[1].held[0] == t.nodes[2].held[0]);
+    CHECK(t.nodes[1].held[1] == t.nodes[2].held[1]);
+    CHECK(t.nodes[1].held[0] != t.nodes[1].held[1]);
+
+    /* Neither copy goes back while node 2 still has it */
+    node_complete(&t, 1);
+    CHECK(vswitch_forward_burst(&t.lib, 0) == 0);
+    CHECK(pool_free_count(&t.pools[1]) == POOL_BUFS - 2);
+
+    node_complete(&t, 2);
+    node_complete(&t, 0);
+    node_complete(&t, 3);
+    CHECK(vswitch_forward_burst(&t.lib, 0) == 0);
+    for (unsigned i = 0; i < 3; i++) {
+        CHECK(pool_free_count(&t.pools[i]) == POOL_BUFS);
+    }
+
+    topology_free(&t);
+}
+
+/* Copies of a broadcast that don't fit in a destination's ring are
+ * dropped without disturbing the copies that were delivered
+ */
+static void test_broadcast_ring_full(void)
+{
+    static const int pool_of[] = { 0, 1, 1 };
+    test_topology_t t;
+
+    topology_init(&t, 3, pool_of);
+
+    /* Fill node 2's ring with frames it doesn't complete */
+    for (unsigned i = 0; i < QUEUE_LEN; i++) {
+        node_send(&t, 0, &t.nodes[2].mac, 64);
+    }
+    CHECK(vswitch_forward_burst(&t.lib, 0) == QUEUE_LEN);
+    CHECK(node_reclaim_sent(&t, 0) == QUEUE_LEN);
+    CHECK(pool_free_count(&t.pools[1]) == POOL_BUFS - QUEUE_LEN);
+
+    node_send(&t, 0, &bcast_macaddr, 64);
+    CHECK(vswitch_forward_burst(&t.lib, 0) == 1);
+    CHECK(t.lib.dropped == 1);
+    CHECK(pool_free_count(&t.pools[1]) == POOL_BUFS - QUEUE_LEN - 1);
+
+    CHECK(node_receive(&t, 1, 0, 64) == 1);
+    node_complete(&t, 1);
+    CHECK(vswitch_forward_burst(&t.lib, 0) == 0);
+    CHECK(pool_free_count(&t.pools[1]) == POOL_BUFS - QUEUE_LEN);
+
+    topology_free(&t);
+}
+
+int main(void)
+{
+    test_init_default();
+    test_init_with_size();
+    test_connect_rejects();
+    test_fdb_probe_lengths();
+    test_forward_unicast();
+    test_forward_drops();
+    test_forward_no_send_queue();
+    test_forward_burst_limit();
+    test_set_tx_pool_in_flight();
+    test_broadcast_shared_pool();
+    test_multicast_mixed_pools();
+    test_broadcast_ring_full();
+
+    if (failures != 0) {
+        fprintf(stderr, "%u checks failed\n", failures);
+    }
+    return failures != 0;
+}